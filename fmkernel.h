@@ -0,0 +1,286 @@
+// FM operator and resampling kernels shared by midi.cc and wavegen.cc.
+//
+// Operators are evaluated a block of samples at a time with GCC/Clang vector
+// extensions, so the same code compiles to SSE2 or NEON by default. On x86 a
+// second copy is built for AVX2 and FMA and picked at run time when the CPU
+// supports it. sin() is replaced by a polynomial after range reduction, which
+// is what makes the loop vectorizable.
+#ifndef FMKERNEL_H_
+#define FMKERNEL_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+enum WaveFunc {
+  SINE,
+  SAW,
+};
+
+// One operator over a block of n samples:
+//   out[i] += gain(i) * envelope[i] * wave(phase + i * increment + modulation[i])
+// where gain ramps linearly from gain_begin at i = 0 to gain_end at i = n.
+struct FmOperator {
+  WaveFunc wave = SINE;
+  // In radians.
+  double phase = 0.0;
+  double increment = 0.0;
+  double gain_begin = 1.0;
+  double gain_end = 1.0;
+  // May be null, meaning 1.0.
+  const double* envelope = nullptr;
+  // May be null, meaning 0.0.
+  const double* modulation = nullptr;
+  // Use a lower-degree sine polynomial. The error grows from about 1e-9 to
+  // about 2e-4.
+  bool fast = false;
+};
+
+// How 32-byte vectors are passed and returned depends on whether AVX is
+// enabled, which GCC warns about for every function that does so, even when
+// the function is always inlined. So none of the functions below take or
+// return one by value: they're passed by reference and results go through
+// pointers.
+typedef double FmVec __attribute__((vector_size(32)));
+typedef uint64_t FmVecBits __attribute__((vector_size(32)));
+constexpr int kFmLanes = sizeof(FmVec) / sizeof(double);
+
+#define FM_INLINE inline __attribute__((always_inline))
+
+FM_INLINE void FmLoad(const double* p, FmVec* v) {
+  memcpy(v, p, sizeof(*v));
+}
+
+FM_INLINE void FmStore(double* p, const FmVec& v) {
+  memcpy(p, &v, sizeof(v));
+}
+
+// Rounds to the nearest integer by adding and subtracting 1.5 * 2^52, which
+// pushes the fraction out of the mantissa. *parity gets the lowest bit of the
+// result. Valid while |x| < 2^51.
+FM_INLINE void FmRound(const FmVec& x, FmVec* rounded, FmVecBits* parity) {
+  const double kMagic = 6755399441055744.0;
+  const FmVec shifted = x + kMagic;
+  *parity = (FmVecBits)shifted & 1;
+  *rounded = shifted - kMagic;
+}
+
+// sin(x) = (-1)^k sin(x - k pi) with k = round(x / pi), and the latter is a
+// Taylor polynomial over [-pi/2, pi/2].
+template <bool kFast>
+FM_INLINE void FmSin(const FmVec& x, FmVec* result) {
+  // pi split in two so that k * pi stays exact for large k.
+  const double kPiHigh = 3.14159265358979311600e+00;
+  const double kPiLow = 1.22464679914735320717e-16;
+  FmVec k;
+  FmVecBits parity;
+  FmRound(x * (1.0 / kPiHigh), &k, &parity);
+  const FmVec r = x - k * kPiHigh - k * kPiLow;
+  const FmVec r2 = r * r;
+  FmVec poly;
+  if (kFast) {
+    poly = FmVec{} + -1.0 / 5040.0;
+  } else {
+    poly = FmVec{} + 1.0 / 6227020800.0;
+    poly = -1.0 / 39916800.0 + r2 * poly;
+    poly = 1.0 / 362880.0 + r2 * poly;
+    poly = -1.0 / 5040.0 + r2 * poly;
+  }
+  poly = 1.0 / 120.0 + r2 * poly;
+  poly = -1.0 / 6.0 + r2 * poly;
+  const FmVec sin_r = r + r * r2 * poly;
+  *result = (FmVec)((FmVecBits)sin_r ^ (parity << 63));
+}
+
+// 2 * frac(x / 2 pi) - 1, truncating towards zero like fmod().
+FM_INLINE void FmSaw(const FmVec& rad, FmVec* result) {
+  const FmVec x = rad * (1.0 / (2 * 3.1415926535897932384626));
+  const FmVec zero = FmVec{};
+  FmVec whole;
+  FmVecBits parity;
+  FmRound(x, &whole, &parity);
+  // Comparisons give -1 for true.
+  whole += __builtin_convertvector((whole > x) & (x >= zero), FmVec);
+  whole -= __builtin_convertvector((whole < x) & (x < zero), FmVec);
+  *result = 2.0 * (x - whole) - 1.0;
+}
+
+template <bool kFast>
+FM_INLINE void FmWave(WaveFunc wave, const FmVec& rad, FmVec* result) {
+  if (wave == SINE)
+    FmSin<kFast>(rad, result);
+  else
+    FmSaw(rad, result);
+}
+
+template <bool kFast>
+FM_INLINE void FmRenderImpl(const FmOperator& op, double* out, size_t n) {
+  const double slope = n > 0 ? (op.gain_end - op.gain_begin) / n : 0.0;
+  FmVec lane;
+  for (int i = 0; i < kFmLanes; ++i)
+    lane[i] = i;
+
+  size_t i = 0;
+  for (; i + kFmLanes <= n; i += kFmLanes) {
+    const FmVec index = lane + static_cast<double>(i);
+    FmVec rad = op.phase + index * op.increment;
+    FmVec v;
+    if (op.modulation) {
+      FmLoad(op.modulation + i, &v);
+      rad += v;
+    }
+    FmVec gain = op.gain_begin + index * slope;
+    if (op.envelope) {
+      FmLoad(op.envelope + i, &v);
+      gain *= v;
+    }
+    FmVec wave;
+    FmWave<kFast>(op.wave, rad, &wave);
+    FmLoad(out + i, &v);
+    FmStore(out + i, v + gain * wave);
+  }
+
+  // The last partial vector goes through a padded copy.
+  if (i < n) {
+    double modulation[kFmLanes] = {};
+    double envelope[kFmLanes] = {};
+    double result[kFmLanes] = {};
+    for (size_t j = i; j < n; ++j) {
+      modulation[j - i] = op.modulation ? op.modulation[j] : 0.0;
+      envelope[j - i] = op.envelope ? op.envelope[j] : 1.0;
+    }
+    const FmVec index = lane + static_cast<double>(i);
+    FmVec rad, gain, wave;
+    FmLoad(modulation, &rad);
+    rad += op.phase + index * op.increment;
+    FmLoad(envelope, &gain);
+    gain *= op.gain_begin + index * slope;
+    FmWave<kFast>(op.wave, rad, &wave);
+    FmStore(result, gain * wave);
+    for (size_t j = i; j < n; ++j)
+      out[j] += result[j - i];
+  }
+}
+
+template <bool kFast>
+void FmRenderDefault(const FmOperator& op, double* out, size_t n) {
+  FmRenderImpl<kFast>(op, out, n);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+template <bool kFast>
+__attribute__((target("avx2,fma"))) void FmRenderAvx2(const FmOperator& op, double* out, size_t n) {
+  FmRenderImpl<kFast>(op, out, n);
+}
+#endif
+
+typedef void (*FmRenderFunc)(const FmOperator& op, double* out, size_t n);
+
+// Returns the fastest implementation the CPU supports.
+template <bool kFast>
+FmRenderFunc SelectFmRender() {
+#if defined(__x86_64__) || defined(__i386__)
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+    return FmRenderAvx2<kFast>;
+#endif
+  return FmRenderDefault<kFast>;
+}
+
+// Adds n samples of op to out.
+inline void FmRender(const FmOperator& op, double* out, size_t n) {
+  static const FmRenderFunc kRender = SelectFmRender<false>();
+  static const FmRenderFunc kFastRender = SelectFmRender<true>();
+  (op.fast ? kFastRender : kRender)(op, out, n);
+}
+
+#if defined(__clang__)
+#define FM_SHUFFLE(a, b, i0, i1, i2, i3) __builtin_shufflevector(a, b, i0, i1, i2, i3)
+#else
+#define FM_SHUFFLE(a, b, i0, i1, i2, i3) __builtin_shuffle(a, b, FmVecBits{i0, i1, i2, i3})
+#endif
+
+// Polyphase FIR interpolation, used for resampling:
+//   out[i * factor + p] = sum of taps[p * num_taps + j] * in[i + j]
+// for i < n, p < factor and j < num_taps. kFmLanes inputs are filtered at
+// once; for factors 2 and 4 the phases are interleaved in registers and
+// stored as whole vectors, which is what makes this fast, while other
+// factors are stored a sample at a time.
+FM_INLINE void FmInterpolateImpl(const double* taps, int num_taps, int factor,
+                                 const double* in, double* out, size_t n) {
+  size_t i = 0;
+  if (factor == 2) {
+    for (; i + kFmLanes <= n; i += kFmLanes) {
+      FmVec a = FmVec{};
+      FmVec b = FmVec{};
+      for (int j = 0; j < num_taps; ++j) {
+        FmVec x;
+        FmLoad(in + i + j, &x);
+        a += taps[j] * x;
+        b += taps[num_taps + j] * x;
+      }
+      FmStore(out + i * 2, FM_SHUFFLE(a, b, 0, 4, 1, 5));
+      FmStore(out + i * 2 + 4, FM_SHUFFLE(a, b, 2, 6, 3, 7));
+    }
+  } else if (factor == 4) {
+    for (; i + kFmLanes <= n; i += kFmLanes) {
+      FmVec sums[4] = {};
+      for (int j = 0; j < num_taps; ++j) {
+        FmVec x;
+        FmLoad(in + i + j, &x);
+        for (int p = 0; p < 4; ++p)
+          sums[p] += taps[p * num_taps + j] * x;
+      }
+      // 4x4 transpose, so that each vector holds the phases of one input.
+      const FmVec t0 = FM_SHUFFLE(sums[0], sums[1], 0, 4, 2, 6);
+      const FmVec t1 = FM_SHUFFLE(sums[0], sums[1], 1, 5, 3, 7);
+      const FmVec t2 = FM_SHUFFLE(sums[2], sums[3], 0, 4, 2, 6);
+      const FmVec t3 = FM_SHUFFLE(sums[2], sums[3], 1, 5, 3, 7);
+      FmStore(out + i * 4, FM_SHUFFLE(t0, t2, 0, 1, 4, 5));
+      FmStore(out + i * 4 + 4, FM_SHUFFLE(t1, t3, 0, 1, 4, 5));
+      FmStore(out + i * 4 + 8, FM_SHUFFLE(t0, t2, 2, 3, 6, 7));
+      FmStore(out + i * 4 + 12, FM_SHUFFLE(t1, t3, 2, 3, 6, 7));
+    }
+  }
+  for (; i < n; ++i) {
+    for (int p = 0; p < factor; ++p) {
+      double sum = 0.0;
+      for (int j = 0; j < num_taps; ++j)
+        sum += taps[p * num_taps + j] * in[i + j];
+      out[i * factor + p] = sum;
+    }
+  }
+}
+
+inline void FmInterpolateDefault(const double* taps, int num_taps, int factor,
+                                 const double* in, double* out, size_t n) {
+  FmInterpolateImpl(taps, num_taps, factor, in, out, n);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2,fma"))) inline void FmInterpolateAvx2(
+    const double* taps, int num_taps, int factor, const double* in, double* out, size_t n) {
+  FmInterpolateImpl(taps, num_taps, factor, in, out, n);
+}
+#endif
+
+typedef void (*FmInterpolateFunc)(const double* taps, int num_taps, int factor,
+                                  const double* in, double* out, size_t n);
+
+inline FmInterpolateFunc SelectFmInterpolate() {
+#if defined(__x86_64__) || defined(__i386__)
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+    return FmInterpolateAvx2;
+#endif
+  return FmInterpolateDefault;
+}
+
+inline void FmInterpolate(const double* taps, int num_taps, int factor,
+                          const double* in, double* out, size_t n) {
+  static const FmInterpolateFunc kInterpolate = SelectFmInterpolate();
+  kInterpolate(taps, num_taps, factor, in, out, n);
+}
+
+#undef FM_SHUFFLE
+#undef FM_INLINE
+
+#endif  // FMKERNEL_H_
@@ -0,0 +1,360 @@
+// Streaming gzip decoder (RFC 1951 and RFC 1952).
+// Based on https://cs.opensource.google/go/go/+/38801e55dbdd19d69935b92e38b1a4c9949316bf:src/lib/compress/flate/inflate.go;bpv=0
+//
+// GzipReader decompresses into caller-provided buffers a piece at a time and
+// keeps only the last 32 KiB of output, which is as far back as deflate can
+// refer, so the decompressed data never has to be in memory at once.
+#ifndef GUNZIP_H_
+#define GUNZIP_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+const int kNumMetaCode = 19;
+const uint32_t kMetaCodeOrder[kNumMetaCode] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+const int kMaxCodeLength = 15;
+const size_t kWindowSize = 32768;
+
+// Base lengths and extra bits of length symbols 257 to 285.
+const uint16_t kLengthBase[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+const uint8_t kLengthExtra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+// Base distances and extra bits of distance symbols 0 to 29.
+const uint16_t kDistBase[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+const uint8_t kDistExtra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+inline bool IsGzip(const uint8_t* data, size_t size) {
+    return size >= 2 && data[0] == 0x1f && data[1] == 0x8b;
+}
+
+inline uint32_t UpdateCrc32(uint32_t crc, uint8_t byte) {
+    static const std::vector<uint32_t> table = [] {
+        std::vector<uint32_t> table(256);
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int j = 0; j < 8; ++j)
+                c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+            table[i] = c;
+        }
+        return table;
+    }();
+    return table[(crc ^ byte) & 0xff] ^ (crc >> 8);
+}
+
+// Reads bits least significant first. Reading past the end yields zeros and
+// sets overrun().
+class BitReader {
+public:
+    BitReader() {}
+    BitReader(const uint8_t* data, const uint8_t* end) : data_(data), end_(end) {}
+    // requested_count is at most 16.
+    uint32_t Read(uint32_t requested_count) {
+        uint32_t result = Get(requested_count);
+        bytes_ >>= requested_count;
+        available_count_ -= requested_count;
+        return result;
+    }
+    uint32_t Get(uint32_t requested_count) {
+        FillIfNeeded(requested_count);
+        return bytes_ & ((1u << requested_count) - 1);
+    }
+    // Drops the rest of the current byte.
+    void AlignToByte() {
+        Read(available_count_ % 8);
+    }
+    bool overrun() const {
+        return overrun_;
+    }
+private:
+    void FillIfNeeded(uint32_t requested_count) {
+        while (available_count_ < requested_count) {
+            if (data_ < end_)
+                bytes_ |= (uint32_t)(*data_++) << available_count_;
+            else
+                overrun_ = true;
+            available_count_ += 8;
+        }
+    }
+    uint32_t bytes_ = 0;
+    uint32_t available_count_ = 0;
+    const uint8_t* data_ = nullptr;
+    const uint8_t* end_ = nullptr;
+    bool overrun_ = false;
+};
+
+// Canonical Huffman code, decoded a bit at a time by counting the codes of
+// each length as in zlib's puff.
+class Huffman {
+public:
+    // Returns false if the lengths over-subscribe the code. Incomplete codes
+    // are accepted; their unused codes fail to decode.
+    bool Init(const std::vector<int>& lengths) {
+        for (int i = 0; i <= kMaxCodeLength; ++i)
+            counts_[i] = 0;
+        for (int length : lengths)
+            ++counts_[length];
+        counts_[0] = 0;
+        int left = 1;
+        for (int i = 1; i <= kMaxCodeLength; ++i) {
+            left = (left << 1) - counts_[i];
+            if (left < 0)
+                return false;
+        }
+        // Symbols ordered by code, i.e. by length and then by value.
+        int offsets[kMaxCodeLength + 1] = {};
+        for (int i = 1; i < kMaxCodeLength; ++i)
+            offsets[i + 1] = offsets[i] + counts_[i];
+        symbols_.assign(lengths.size(), 0);
+        for (int i = 0; i < lengths.size(); ++i) {
+            if (lengths[i] > 0)
+                symbols_[offsets[lengths[i]]++] = i;
+        }
+        return true;
+    }
+
+    // Returns -1 if the bits don't match any symbol.
+    int Read(BitReader& reader) const {
+        int code = 0;
+        int first = 0;
+        int index = 0;
+        for (int i = 1; i <= kMaxCodeLength; ++i) {
+            code |= reader.Read(1);
+            const int count = counts_[i];
+            if (code - first < count)
+                return symbols_[index + code - first];
+            index += count;
+            first = (first + count) << 1;
+            code <<= 1;
+        }
+        return -1;
+    }
+
+private:
+    int counts_[kMaxCodeLength + 1] = {};
+    std::vector<uint16_t> symbols_;
+};
+
+class GzipReader {
+public:
+    // Reads the gzip header of data, which must outlive the reader.
+    bool Open(const uint8_t* data, size_t size) {
+        const uint8_t* end = data + size;
+        if (size < 18 || !IsGzip(data, size) || data[2] != 8)
+            return Fail("not a gzip file");
+        const uint8_t flags = data[3];
+        if (flags & 0xe0)
+            return Fail("unknown gzip flags");
+        data += 10;
+        if (flags & 4) {
+            const size_t length = data[0] | data[1] << 8;
+            data += 2 + length;
+        }
+        for (int flag : {8, 16}) {
+            // File name and comment
+            if (flags & flag) {
+                while (data < end && *data)
+                    ++data;
+                ++data;
+            }
+        }
+        if (flags & 2)
+            data += 2;
+        if (data >= end)
+            return Fail("truncated gzip header");
+        reader_ = BitReader(data, end);
+        return true;
+    }
+
+    // Decompresses up to n bytes into out and returns how many were written.
+    // Fewer than n means the end of the data or an error; see ok().
+    size_t Read(uint8_t* out, size_t n) {
+        size_t written = 0;
+        while (written < n && ok() && state_ != DONE) {
+            if (copy_length_ > 0) {
+                out[written++] = Emit(window_[(total_ - copy_distance_) % kWindowSize]);
+                --copy_length_;
+            } else if (state_ == STORED) {
+                if (stored_length_ > 0) {
+                    out[written++] = Emit(reader_.Read(8));
+                    --stored_length_;
+                } else {
+                    EndBlock();
+                }
+            } else if (state_ == COMPRESSED) {
+                const int symbol = literal_code_.Read(reader_);
+                if (symbol < 0)
+                    Fail("invalid literal/length code");
+                else if (symbol < 256)
+                    out[written++] = Emit(symbol);
+                else if (symbol == 256)
+                    EndBlock();
+                else
+                    ReadCopy(symbol);
+            } else {
+                ReadBlockHeader();
+            }
+            if (reader_.overrun())
+                Fail("unexpected end of gzip data");
+        }
+        return written;
+    }
+
+    bool ok() const {
+        return error_ == nullptr;
+    }
+    const char* error() const {
+        return error_;
+    }
+
+private:
+    enum State {
+        BLOCK_HEADER,
+        STORED,
+        COMPRESSED,
+        DONE,
+    };
+
+    bool Fail(const char* error) {
+        if (!error_)
+            error_ = error;
+        return false;
+    }
+
+    uint8_t Emit(uint8_t byte) {
+        window_[total_ % kWindowSize] = byte;
+        ++total_;
+        crc_ = UpdateCrc32(crc_, byte);
+        return byte;
+    }
+
+    void ReadBlockHeader() {
+        final_ = reader_.Read(1);
+        const uint32_t type = reader_.Read(2);
+        if (type == 0) {
+            reader_.AlignToByte();
+            stored_length_ = reader_.Read(16);
+            if (reader_.Read(16) != (~stored_length_ & 0xffff)) {
+                Fail("corrupt stored block length");
+                return;
+            }
+            state_ = STORED;
+        } else if (type == 1) {
+            std::vector<int> lengths(288, 8);
+            for (int i = 144; i < 256; ++i)
+                lengths[i] = 9;
+            for (int i = 256; i < 280; ++i)
+                lengths[i] = 7;
+            literal_code_.Init(lengths);
+            dist_code_.Init(std::vector<int>(30, 5));
+            state_ = COMPRESSED;
+        } else if (type == 2) {
+            if (ReadDynamicCodes())
+                state_ = COMPRESSED;
+        } else {
+            Fail("invalid block type");
+        }
+    }
+
+    bool ReadDynamicCodes() {
+        uint32_t nlit = reader_.Read(5) + 257;
+        uint32_t ndist = reader_.Read(5) + 1;
+        uint32_t nclen = reader_.Read(4) + 4;
+        if (nlit > 286 || ndist > 30)
+            return Fail("too many length or distance codes");
+        std::vector<int> metaCodeLengths(kNumMetaCode, 0);
+        for (int i = 0; i < nclen; ++i)
+            metaCodeLengths[kMetaCodeOrder[i]] = reader_.Read(3);
+        Huffman metaCode;
+        if (!metaCode.Init(metaCodeLengths))
+            return Fail("invalid code length code");
+        std::vector<int> codeLengths;
+        while (codeLengths.size() < nlit + ndist) {
+            int symbol = metaCode.Read(reader_);
+            uint32_t rep = 0;
+            int length = 0;
+            if (symbol < 0) {
+                return Fail("invalid code length code");
+            } else if (symbol < 16) {
+                rep = 1;
+                length = symbol;
+            } else if (symbol == 16) {
+                if (codeLengths.empty())
+                    return Fail("repeated code length without a previous one");
+                rep = reader_.Read(2) + 3;
+                length = codeLengths.back();
+            } else if (symbol == 17) {
+                rep = reader_.Read(3) + 3;
+            } else {
+                rep = reader_.Read(7) + 11;
+            }
+            if (codeLengths.size() + rep > nlit + ndist)
+                return Fail("too many code lengths");
+            codeLengths.insert(codeLengths.end(), rep, length);
+        }
+        if (codeLengths[256] == 0)
+            return Fail("missing end-of-block code");
+        if (!literal_code_.Init(std::vector<int>(codeLengths.begin(), codeLengths.begin() + nlit)) ||
+            !dist_code_.Init(std::vector<int>(codeLengths.begin() + nlit, codeLengths.end())))
+            return Fail("invalid literal/length or distance code");
+        return true;
+    }
+
+    void ReadCopy(int symbol) {
+        symbol -= 257;
+        if (symbol >= 29) {
+            Fail("invalid length code");
+            return;
+        }
+        copy_length_ = kLengthBase[symbol] + reader_.Read(kLengthExtra[symbol]);
+        symbol = dist_code_.Read(reader_);
+        if (symbol < 0 || symbol >= 30) {
+            Fail("invalid distance code");
+            return;
+        }
+        copy_distance_ = kDistBase[symbol] + reader_.Read(kDistExtra[symbol]);
+        if (copy_distance_ > total_)
+            Fail("distance too far back");
+    }
+
+    void EndBlock() {
+        if (!final_) {
+            state_ = BLOCK_HEADER;
+            return;
+        }
+        // The trailer holds the CRC-32 and the length modulo 2^32.
+        reader_.AlignToByte();
+        uint32_t trailer[2] = {};
+        for (int i = 0; i < 8; ++i)
+            trailer[i / 4] |= reader_.Read(8) << (i % 4 * 8);
+        if (trailer[0] != ~crc_)
+            Fail("CRC mismatch");
+        else if (trailer[1] != (uint32_t)total_)
+            Fail("length mismatch");
+        state_ = DONE;
+    }
+
+    BitReader reader_;
+    Huffman literal_code_;
+    Huffman dist_code_;
+    State state_ = BLOCK_HEADER;
+    bool final_ = false;
+    uint32_t stored_length_ = 0;
+    uint32_t copy_length_ = 0;
+    uint32_t copy_distance_ = 0;
+    // The last kWindowSize bytes of output, indexed by position modulo
+    // kWindowSize.
+    std::vector<uint8_t> window_ = std::vector<uint8_t>(kWindowSize);
+    uint64_t total_ = 0;
+    uint32_t crc_ = 0xffffffff;
+    const char* error_ = nullptr;
+};
+
+#endif  // GUNZIP_H_
@@ -0,0 +1,1524 @@
+#ifndef MIDI_H_
+#define MIDI_H_
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <limits>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <queue>
+#include <set>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "fmkernel.h"
+#include "gunzip.h"
+#include "wav.h"
+
+constexpr double pi = 3.1415926535897932384626;
+// Sample rate of the output.
+constexpr int32_t kSampleRate = 44100;
+// Longer songs are refused. A song is rendered into a single buffer of about
+// 1.3 GB per hour, so a stray delta time of a few days can't be rendered.
+constexpr double kMaxSongSeconds = 3 * 3600.0;
+
+// Trades accuracy for speed. Voices are synthesized at sample_rate and then
+// resampled to kSampleRate.
+struct Quality {
+  const char* name;
+  int32_t sample_rate;
+  // Use the lower-degree sine polynomial of FmRender().
+  bool fast_oscillators;
+};
+
+constexpr Quality kQualities[] = {
+  {"final", kSampleRate, false},
+  {"preview", kSampleRate / 2, true},
+  {"draft", kSampleRate / 4, true},
+};
+
+inline const Quality* FindQuality(const char* name) {
+  for (const Quality& quality : kQualities) {
+    if (strcmp(quality.name, name) == 0)
+      return &quality;
+  }
+  return nullptr;
+}
+
+// Returns the first sample at or after t.
+inline size_t FirstSampleAt(double t, int32_t sample_rate) {
+  size_t i = static_cast<size_t>(std::max(0.0, ceil(t * sample_rate)));
+  while (i > 0 && 1.0 * (i - 1) / sample_rate >= t)
+    --i;
+  while (1.0 * i / sample_rate < t)
+    ++i;
+  return i;
+}
+
+inline double MidiFreq(int n) {
+  return pow(2, (n - 69.0) / 12.0) * 440.0;
+}
+
+// http://www.music.mcgill.ca/~ich/classes/mumt306/StandardMIDIfileformat.html
+
+struct __attribute__((__packed__)) MIDIHeader {
+  char magic[4] = {};
+  uint32_t length = 0;
+  uint16_t format = 0;
+  uint16_t ntrks = 0;
+  uint16_t division = 0;
+
+  void Read(const uint8_t* data) {
+    memcpy(this, data, sizeof(*this));
+    length = ntohl(length);
+    format = ntohs(format);
+    ntrks = ntohs(ntrks);
+    division = ntohs(division);
+  }
+
+  // A division of 0 would make every event infinitely long.
+  bool is_valid() const {
+    return memcmp(magic, "MThd", 4) == 0 && length >= 6 && division != 0;
+  }
+
+  void Dump() const {
+    printf("%.4s length = %u, format = %u, ntrks = %u, division = %u\n",
+           magic, length, format, ntrks, division);
+  }
+};
+
+struct __attribute__((__packed__)) MIDITrack {
+  char magic[4] = {};
+  uint32_t length = 0;
+
+  void Read(const uint8_t* data) {
+    memcpy(this, data, sizeof(*this));
+    length = ntohl(length);
+  }
+
+  bool is_track() const {
+    return memcmp(magic, "MTrk", 4) == 0;
+  }
+
+  void Dump() const {
+    printf("%.4s length = %u\n", magic, length);
+  }
+};
+
+enum MIDIEventType {
+  NOTE_OFF = 0x80,
+  NOTE_ON = 0x90,
+  POLYPHONIC_KEY_PRESSURE = 0xA0,
+  CONTROL_CHANGE = 0xB0,
+  PROGRAM_CHANGE = 0xC0,
+  CHANNEL_PRESSURE = 0xD0,
+  PITCH_BEND = 0xE0,
+  SYSEX = 0xF0,
+  METADATA = 0xFF,
+};
+
+enum MIDIMetadataType {
+  END_OF_TRACK = 0x2F,
+  SET_TEMPO = 0x51,
+};
+
+inline const char* GetEventTypeName(MIDIEventType event_type) {
+  switch (event_type) {
+    case NOTE_OFF: return "NOTE_OFF";
+    case NOTE_ON: return "NOTE_ON";
+    case POLYPHONIC_KEY_PRESSURE: return "POLYPHONIC_KEY_PRESSURE";
+    case CONTROL_CHANGE: return "CONTROL_CHANGE";
+    case PROGRAM_CHANGE: return "PROGRAM_CHANGE";
+    case CHANNEL_PRESSURE: return "CHANNEL_PRESSURE";
+    case PITCH_BEND: return "PITCH_BEND";
+    case SYSEX: return "SYSEX";
+    case METADATA: return "METADATA";
+    default: return "(undefined)";
+  }
+}
+
+struct MIDIEvent {
+  uint32_t delta_time = 0;
+  uint32_t absolute_time = 0;
+  uint8_t status = 0;
+  uint8_t data1 = 0;
+  uint8_t data2 = 0;
+  // Shared between copies of the event and freed with the last one.
+  std::shared_ptr<uint8_t> metadata;
+  uint32_t metadata_length = 0;
+
+  // Reads one event from p and advances p past it. Returns false if the
+  // event runs past end or its type is unsupported.
+  bool Read(const uint8_t*& p, const uint8_t* end, uint8_t prev_status) {
+    if (!ReadVariableLength(p, end, &delta_time) || p >= end)
+      return false;
+
+    // Running status
+    status = *p;
+    if ((status & 0x80) == 0)
+      status = prev_status;
+    else
+      ++p;
+
+    if (status == 0xFF || status == 0xF0 || status == 0xF7) {
+      if (status == 0xFF) {
+        if (p >= end)
+          return false;
+        data1 = *p++;
+      }
+      if (!ReadVariableLength(p, end, &metadata_length) || metadata_length > end - p)
+        return false;
+      metadata.reset(new uint8_t[metadata_length], std::default_delete<uint8_t[]>());
+      memcpy(metadata.get(), p, metadata_length);
+      p += metadata_length;
+      return true;
+    }
+    switch (event_type()) {
+      case PROGRAM_CHANGE:
+      case CHANNEL_PRESSURE:
+        if (end - p < 1)
+          return false;
+        data1 = *p++;
+        return true;
+      case NOTE_OFF:
+      case NOTE_ON:
+      case POLYPHONIC_KEY_PRESSURE:
+      case CONTROL_CHANGE:
+      case PITCH_BEND:
+        if (end - p < 2)
+          return false;
+        data1 = *p++;
+        data2 = *p++;
+        return true;
+      default:
+        return false;
+    }
+  }
+
+  static bool ReadVariableLength(const uint8_t*& p, const uint8_t* end, uint32_t* x) {
+    *x = 0;
+    for (int i = 0; i < 4 && p < end; ++i) {
+      uint32_t c = *p++;
+      *x <<= 7;
+      *x |= c & 0x7F;
+      if ((c & 0x80) == 0)
+        return true;
+    }
+    return false;
+  }
+
+  void Dump() const {
+    printf("%s", GetEventTypeName(event_type()));
+    switch (event_type()) {
+      case NOTE_ON:
+        printf(" channel = %d note = %d velocity = %d\n", channel(), note(), velocity());
+        break;
+      case NOTE_OFF:
+        printf(" channel = %d note = %d\n", channel(), note());
+        break;
+      default:
+        printf("\n");
+        break;
+    }
+  }
+
+  double GetAbsoluteTimeInSeconds(const MIDIHeader& header, uint32_t tempo) const {
+    // division = ticks/quarter-note
+    // tempo = ms/quarter-note
+    // ticks / division * tempo = ms
+    return 1.0 * absolute_time / header.division * tempo / 1000.0 / 1000.0;
+  }
+
+  MIDIEventType event_type() const {
+    if (status == METADATA)
+      return METADATA;
+    return static_cast<MIDIEventType>(status & 0xF0);
+  }
+
+  MIDIMetadataType metadata_type() const {
+    return static_cast<MIDIMetadataType>(data1);
+  }
+
+  int channel() const {
+    return status & 0x0F;
+  }
+
+  int note() const {
+    return data1 & 0x7F;
+  }
+
+  int velocity() const {
+    return data2 & 0x7F;
+  }
+
+  int tempo() const {
+    int tempo = 0;
+    for (uint32_t i = 0; i < 3 && i < metadata_length; ++i) {
+      tempo <<= 8;
+      tempo += metadata.get()[i];
+    }
+    return tempo;
+  }
+
+  int program() const {
+    return data1 & 0x7F;
+  }
+};
+
+// A track chunk body, pointing into the mapped file or a decompressed buffer.
+struct TrackData {
+  const uint8_t* begin;
+  const uint8_t* end;
+};
+
+// Locates the MTrk chunks by walking the chunk headers, so that every track
+// can be parsed independently. Unknown chunk types are skipped as the spec
+// requires.
+inline std::vector<TrackData> FindTracks(const uint8_t* data, size_t size) {
+  std::vector<TrackData> tracks;
+  MIDIHeader header;
+  header.Read(data);
+  size_t pos = 8 + header.length;
+  while (pos + sizeof(MIDITrack) <= size) {
+    MIDITrack track;
+    track.Read(data + pos);
+    pos += sizeof(MIDITrack);
+    const size_t length = std::min<size_t>(track.length, size - pos);
+    if (track.is_track())
+      tracks.push_back(TrackData{data + pos, data + pos + length});
+    pos += length;
+  }
+  return tracks;
+}
+
+// Returns false if an event is truncated or unsupported.
+inline bool ParseTrack(const TrackData& track, std::vector<MIDIEvent>* events) {
+  const uint8_t* p = track.begin;
+  uint8_t prev_status = 0;
+  uint32_t current_time = 0;
+  while (p < track.end) {
+    MIDIEvent event;
+    if (!event.Read(p, track.end, prev_status))
+      return false;
+    prev_status = event.status;
+    current_time += event.delta_time;
+    event.absolute_time = current_time;
+    events->push_back(event);
+  }
+  return true;
+}
+
+// Parses every track on its own thread, up to max_threads. Tracks are handed
+// out one at a time so that a few long tracks don't leave the other threads
+// idle. Returns false if any track is malformed.
+inline bool ParseTracks(const std::vector<TrackData>& tracks, size_t max_threads,
+                        std::vector<std::vector<MIDIEvent>>* result) {
+  result->assign(tracks.size(), std::vector<MIDIEvent>());
+  std::vector<char> ok(tracks.size());
+  std::atomic<size_t> next(0);
+  auto worker = [&]() {
+    for (size_t i = next++; i < tracks.size(); i = next++)
+      ok[i] = ParseTrack(tracks[i], &(*result)[i]);
+  };
+  const size_t num_threads = std::min(tracks.size(), std::max<size_t>(1, max_threads));
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < num_threads; ++i)
+    threads.emplace_back(worker);
+  worker();
+  for (auto& thread : threads)
+    thread.join();
+  return std::find(ok.begin(), ok.end(), 0) == ok.end();
+}
+
+// Merges the per-track event lists, each already ordered by time. Events at
+// the same tick keep their order within a track and lower-numbered tracks
+// come first, so the result is the same as a stable sort of all tracks
+// concatenated.
+inline std::vector<MIDIEvent> MergeTracks(const std::vector<std::vector<MIDIEvent>>& tracks) {
+  // <<absolute_time, track>, index>
+  typedef std::pair<std::pair<uint32_t, size_t>, size_t> Cursor;
+  std::priority_queue<Cursor, std::vector<Cursor>, std::greater<Cursor>> queue;
+  size_t total = 0;
+  for (size_t i = 0; i < tracks.size(); ++i) {
+    total += tracks[i].size();
+    if (!tracks[i].empty())
+      queue.push(Cursor{{tracks[i][0].absolute_time, i}, 0});
+  }
+
+  std::vector<MIDIEvent> events;
+  events.reserve(total);
+  while (!queue.empty()) {
+    const size_t track = queue.top().first.second;
+    const size_t index = queue.top().second;
+    queue.pop();
+    events.push_back(tracks[track][index]);
+    if (index + 1 < tracks[track].size())
+      queue.push(Cursor{{tracks[track][index + 1].absolute_time, track}, index + 1});
+  }
+  return events;
+}
+
+// A parsed MIDI file with every track merged into one timeline.
+struct Song {
+  MIDIHeader header;
+  std::vector<MIDIEvent> events;
+  // Microseconds per quarter note. 120 bpm unless the song sets a tempo.
+  uint32_t tempo = 500000;
+
+  double GetTime(const MIDIEvent& event) const {
+    return event.GetAbsoluteTimeInSeconds(header, tempo);
+  }
+
+  double duration() const {
+    return events.empty() ? 0.0 : GetTime(events.back());
+  }
+};
+
+// Reads up to length bytes of a chunk into body. body grows only as data
+// arrives, so a corrupt length can't make it larger than the stream.
+inline void ReadChunk(GzipReader& reader, uint32_t length, std::vector<uint8_t>* body) {
+  const size_t kStep = 65536;
+  body->clear();
+  while (body->size() < length) {
+    const size_t size = body->size();
+    const size_t n = std::min<size_t>(kStep, length - size);
+    body->resize(size + n);
+    const size_t read = reader.Read(body->data() + size, n);
+    body->resize(size + read);
+    if (read < n)
+      break;
+  }
+}
+
+// Parses a gzip-compressed MIDI file as it's decompressed, so that neither
+// the whole file nor a temporary copy of it is ever needed. Only the chunk
+// being parsed is buffered, and tracks are parsed one after another as they
+// come out of the decoder. Like FindTracks(), a truncated last track is
+// parsed as far as it goes.
+inline bool ParseCompressedSong(GzipReader& reader, Song* song) {
+  uint8_t header[sizeof(MIDIHeader)];
+  if (reader.Read(header, sizeof(header)) != sizeof(header))
+    return false;
+  song->header.Read(header);
+  if (!song->header.is_valid())
+    return false;
+  std::vector<uint8_t> body;
+  ReadChunk(reader, song->header.length - 6, &body);
+  if (body.size() != song->header.length - 6)
+    return false;
+
+  std::vector<std::vector<MIDIEvent>> tracks;
+  uint8_t chunk[sizeof(MIDITrack)];
+  while (reader.Read(chunk, sizeof(chunk)) == sizeof(chunk)) {
+    MIDITrack track;
+    track.Read(chunk);
+    ReadChunk(reader, track.length, &body);
+    if (track.is_track()) {
+      tracks.emplace_back();
+      if (!ParseTrack(TrackData{body.data(), body.data() + body.size()}, &tracks.back()))
+        return false;
+    }
+  }
+  song->events = MergeTracks(tracks);
+  return reader.ok();
+}
+
+// Loads a MIDI file, which may be gzip-compressed. Uncompressed tracks are
+// parsed on up to max_threads threads.
+inline bool LoadSong(const char* path, Song* song,
+                     size_t max_threads = std::thread::hardware_concurrency()) {
+  int fd = open(path, O_RDONLY, 0);
+  if (fd < 0) {
+    perror("open");
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st)) {
+    perror("fstat");
+    close(fd);
+    return false;
+  }
+  uint8_t* data = (uint8_t*)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED) {
+    perror("mmap");
+    close(fd);
+    return false;
+  }
+  bool ok;
+  if (IsGzip(data, st.st_size)) {
+    GzipReader reader;
+    ok = reader.Open(data, st.st_size) && ParseCompressedSong(reader, song);
+    if (!ok)
+      printf("%s: %s\n", path, reader.ok() ? "malformed MIDI file" : reader.error());
+  } else {
+    song->header = MIDIHeader();
+    if (static_cast<size_t>(st.st_size) >= sizeof(MIDIHeader))
+      song->header.Read(data);
+    std::vector<std::vector<MIDIEvent>> tracks;
+    if (!song->header.is_valid()) {
+      ok = false;
+      printf("%s: not a MIDI file\n", path);
+    } else if (!ParseTracks(FindTracks(data, st.st_size), max_threads, &tracks)) {
+      ok = false;
+      printf("%s: malformed MIDI track\n", path);
+    } else {
+      ok = true;
+      song->events = MergeTracks(tracks);
+    }
+  }
+  munmap(data, st.st_size);
+  close(fd);
+  if (!ok)
+    return false;
+
+  auto it = std::find_if(song->events.begin(), song->events.end(),
+                         [](const MIDIEvent& event) {
+                           return event.event_type() == METADATA &&
+                                  event.metadata_type() == SET_TEMPO;
+                         });
+  if (it != song->events.end())
+    song->tempo = it->tempo();
+  if (song->duration() > kMaxSongSeconds) {
+    printf("%s: %.0f s long; at most %.0f s is supported\n", path, song->duration(),
+           kMaxSongSeconds);
+    return false;
+  }
+  return true;
+}
+
+struct Note;
+struct Program;
+
+// Upper bound of operators in a single program, modulators included.
+constexpr int kMaxOperators = 8;
+constexpr size_t kDefaultPolyphony = 64;
+constexpr size_t kDefaultCacheMiB = 32;
+// Held time of notes never released, and of cached notes that fade out
+// before they're released; those sound the same however long they're held.
+constexpr size_t kAnyHeld = std::numeric_limits<size_t>::max();
+// Cached notes still sounding after this many seconds are rendered live.
+constexpr double kMaxCachedSeconds = 4.0;
+// Voices are rendered this many samples at a time.
+constexpr size_t kBlockSize = 256;
+// Voices that can't get louder than this (about -80 dB) are retired early.
+constexpr double kInaudibleLevel = 1e-4;
+
+struct OperatorState {
+  double last_pressed_envelope = 0.0;
+};
+
+struct Note {
+  const Program* program = nullptr;
+  int note = 0;
+  double velocity = 0.0;
+  // If negative it's a released time.
+  double pressed_time = 0.0;
+  // Oscillator phases are relative to this, so that a note sounds the same
+  // whenever it starts.
+  double start_time = 0.0;
+
+  // Indexed the same as Program::flat.
+  OperatorState operators[kMaxOperators];
+  // Angular frequency of each operator for this note.
+  double omega[kMaxOperators] = {};
+  double sample_rate = kSampleRate;
+  bool fast_oscillators = false;
+
+  Note() {}
+  Note(const Program& program, int note, double velocity, double pressed_time,
+       const Quality& quality);
+
+  // Adds n samples starting at first_sample to out.
+  void Render(double* out, size_t first_sample, size_t n);
+  bool IsFinished(double t) const;
+
+  void Release(double t) {
+    pressed_time = -t;
+  }
+
+  bool is_released() const {
+    return pressed_time < 0.0;
+  }
+  double Delta(double t) const {
+    return pressed_time > 0.0 ? t - pressed_time : t + pressed_time;
+  }
+};
+
+struct Envelope {
+  double attack = 0.0;
+  double decay = 0.0;
+  double sustain = 1.0;
+  double release = 0.0;
+
+  bool reversed = false;
+
+  Envelope(double attack, double decay, double sustain, double release, bool reversed)
+      : attack(attack)
+      , decay(decay)
+      , sustain(sustain)
+      , release(release)
+      , reversed(reversed) {
+  }
+
+  // Writes the level at the n samples from first_sample to out. The note
+  // isn't released or pressed in between, and time only moves forward, so
+  // each segment covers a run of samples and is picked once per run instead
+  // of once per sample. Once the sustain is reached the rest is filled without
+  // looking at the time at all.
+  void Get(Note& note, OperatorState& state, size_t first_sample, size_t n, double* out) const {
+    // Delta() with the branch taken once; t - pressed_time == t + -pressed_time.
+    const double offset = note.pressed_time > 0.0 ? -note.pressed_time : note.pressed_time;
+    const double first = first_sample;
+    auto delta = [&](size_t j) { return (first + j) / note.sample_rate + offset; };
+
+    size_t j = 0;
+    if (note.is_released()) {
+      const double level = state.last_pressed_envelope;
+      for (double d; j < n && (d = delta(j)) < release; ++j)
+        out[j] = level * (1.0 - d / release);
+      std::fill(out + j, out + n, 0.0);
+    } else {
+      for (double d; j < n && (d = delta(j)) < attack; ++j)
+        out[j] = d / attack;
+      for (double d; j < n && (d = delta(j)) < attack + decay; ++j)
+        out[j] = (1.0 - sustain) * (1.0 - (d - attack) / decay) + sustain;
+      std::fill(out + j, out + n, sustain);
+      if (n > 0)
+        state.last_pressed_envelope = out[n - 1];
+    }
+    if (reversed) {
+      for (j = 0; j < n; ++j)
+        out[j] = 1.0 - out[j];
+    }
+  }
+
+  bool IsFinished(const Note& note, double t) const {
+    return note.is_released() && note.Delta(t) > release;
+  }
+
+  // Upper bound of Get() from t on, given that state was last updated at t.
+  // Decay, sustain and release never rise again, so past the attack the
+  // current level is the bound.
+  double UpperBound(const Note& note, const OperatorState& state, double t) const {
+    if (reversed)
+      return 1.0;
+    const double delta = note.Delta(t);
+    if (note.is_released())
+      return delta < release ? state.last_pressed_envelope * (1.0 - delta / release) : 0.0;
+    if (delta < attack)
+      return 1.0;
+    return state.last_pressed_envelope;
+  }
+};
+
+// A node of a patch definition. Programs are written as trees of these and
+// compiled into a flat list of FlatOperators.
+struct Operator {
+  const Envelope envelope;
+  const WaveFunc func;
+  // If negative it's a fixed frequency.
+  const double freq;
+  const double level;
+
+  std::vector<Operator> modulators;
+
+  Operator(const Envelope& envelope,
+           WaveFunc func,
+           double freq,
+           double level,
+           const std::vector<Operator>& modulators)
+      : envelope(envelope)
+      , func(func)
+      , freq(freq)
+      , level(level)
+      , modulators(modulators) {
+  }
+};
+
+struct FlatOperator {
+  Envelope envelope;
+  WaveFunc func;
+  // If negative it's a fixed frequency.
+  double freq;
+  double level;
+  // Index of the operator this one modulates, or -1 if it goes to the output.
+  int target;
+};
+
+struct Program {
+  // The operator tree flattened in post-order, so that every modulator comes
+  // before the operator it modulates.
+  std::vector<FlatOperator> flat;
+  // True if every operator has a fixed frequency, so a note sounds the same
+  // every time it's played with the same velocity and held time.
+  bool deterministic = true;
+
+  Program(const std::vector<Operator>& operators) {
+    for (int i = 0; i < operators.size(); ++i)
+      Flatten(operators[i], -1);
+    if (flat.size() > kMaxOperators) {
+      printf("program has %zu operators; at most %d are supported\n", flat.size(), kMaxOperators);
+      exit(1);
+    }
+    for (int i = 0; i < flat.size(); ++i)
+      deterministic = deterministic && flat[i].freq < 0.0;
+  }
+
+  bool IsFinished(const Note& note, double t) const {
+    for (int i = 0; i < flat.size(); ++i) {
+      if (!flat[i].envelope.IsFinished(note, t)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // True if the note can't be heard anymore. Modulators only change the
+  // phase of their targets, so the carriers' levels bound the output.
+  bool IsInaudible(const Note& note, double t) const {
+    double bound = 0.0;
+    for (int i = 0; i < flat.size(); ++i) {
+      if (flat[i].target < 0)
+        bound += flat[i].level * flat[i].envelope.UpperBound(note, note.operators[i], t);
+    }
+    return bound * note.velocity < kInaudibleLevel;
+  }
+
+ private:
+  // The target of each modulator is only known after it's appended, so it is
+  // patched up once the operator it modulates gets its index.
+  void Flatten(const Operator& op, int target) {
+    const size_t first_modulator = flat.size();
+    for (int i = 0; i < op.modulators.size(); ++i)
+      Flatten(op.modulators[i], -1);
+    const int index = flat.size();
+    for (size_t i = first_modulator; i < flat.size(); ++i) {
+      if (flat[i].target == -1)
+        flat[i].target = index;
+    }
+    flat.push_back(FlatOperator{op.envelope, op.func, op.freq, op.level, target});
+  }
+};
+
+// Adds operator i of note over a block to dest. The envelope is evaluated a
+// segment at a time; the oscillator goes through the vectorized FM kernel.
+inline void RenderOperator(const FlatOperator& op, int i, Note& note,
+                           const double* modulation, double* dest, size_t first_sample, size_t n) {
+  double envelope[kBlockSize];
+  op.envelope.Get(note, note.operators[i], first_sample, n, envelope);
+  FmOperator fm;
+  fm.wave = op.func;
+  fm.phase = note.omega[i] * (1.0 * first_sample / note.sample_rate - note.start_time);
+  fm.increment = note.omega[i] / note.sample_rate;
+  fm.gain_begin = fm.gain_end = op.level;
+  fm.envelope = envelope;
+  fm.modulation = modulation;
+  fm.fast = note.fast_oscillators;
+  FmRender(fm, dest, n);
+}
+
+// Renders a block of a note. Operators are evaluated in the order of
+// program.flat, so every modulation buffer is complete before the operator it
+// modulates reads it. Only the samples of the block are cleared, and only in
+// the buffers of operators the program has.
+inline void RenderProgram(const Program& program, Note& note, double* out, size_t first_sample,
+                          size_t n) {
+  double modulation[kMaxOperators][kBlockSize];
+  double result[kBlockSize];
+  std::fill(result, result + n, 0.0);
+  for (int i = 0; i < program.flat.size(); ++i)
+    std::fill(modulation[i], modulation[i] + n, 0.0);
+  for (int i = 0; i < program.flat.size(); ++i) {
+    const FlatOperator& op = program.flat[i];
+    double* dest = op.target < 0 ? result : modulation[op.target];
+    RenderOperator(op, i, note, modulation[i], dest, first_sample, n);
+  }
+  for (size_t j = 0; j < n; ++j)
+    out[j] += result[j] * note.velocity;
+}
+
+inline Note::Note(const Program& program, int note, double velocity, double pressed_time,
+                  const Quality& quality)
+  : program(&program)
+  , note(note)
+  , velocity(velocity)
+  , pressed_time(pressed_time)
+  , start_time(pressed_time)
+  , sample_rate(quality.sample_rate)
+  , fast_oscillators(quality.fast_oscillators) {
+  for (int i = 0; i < program.flat.size(); ++i) {
+    const double freq = program.flat[i].freq;
+    omega[i] = (freq < 0.0 ? -freq : freq * MidiFreq(note)) * 2.0 * pi;
+  }
+}
+
+inline void Note::Render(double* out, size_t first_sample, size_t n) {
+  RenderProgram(*program, *this, out, first_sample, n);
+}
+
+inline bool Note::IsFinished(double t) const {
+  return program->IsFinished(*this, t) || program->IsInaudible(*this, t);
+}
+
+// Pre-rendered notes of deterministic programs, so that repeated hits (drums
+// mostly) are mixed from memory instead of being synthesized again. Notes are
+// rendered at velocity 1.0 and scaled when mixed, since velocity is only a
+// gain. The note number isn't part of the key either: it only sets the
+// frequency of operators that follow it, and deterministic programs have
+// none. Least recently used notes are evicted once the buffers exceed the
+// memory budget.
+struct VoiceCache {
+  typedef std::shared_ptr<const std::vector<float>> Buffer;
+
+  struct Key {
+    const Program* program;
+    const Quality* quality;
+    // In samples at the quality's sample rate.
+    size_t held;
+
+    bool operator<(const Key& rhs) const {
+      return std::tie(program, quality, held) < std::tie(rhs.program, rhs.quality, rhs.held);
+    }
+  };
+
+  struct Entry {
+    Buffer samples;
+    std::list<Key>::iterator lru;
+  };
+
+  size_t budget_bytes;
+  size_t used_bytes = 0;
+  uint64_t hits = 0;
+  uint64_t misses = 0;
+  uint64_t evictions = 0;
+
+  explicit VoiceCache(size_t budget_bytes) : budget_bytes(budget_bytes) {
+  }
+
+  // Returns the note rendered with a note-off after held samples, or nullptr
+  // if it can't be cached.
+  Buffer Get(const Program& program, const Quality& quality, size_t held) {
+    if (budget_bytes == 0 || !program.deterministic)
+      return nullptr;
+    held = std::max<size_t>(held, 1);
+    auto it = entries.find(Key{&program, &quality, kAnyHeld});
+    if (it == entries.end() || held < it->second.samples->size())
+      it = entries.find(Key{&program, &quality, held});
+    if (it != entries.end()) {
+      ++hits;
+      lru.splice(lru.begin(), lru, it->second.lru);
+      return it->second.samples;
+    }
+    ++misses;
+    if (uncacheable.count(Key{&program, &quality, held}))
+      return nullptr;
+
+    bool faded_out = false;
+    Buffer samples = Render(program, quality, held, &faded_out);
+    const Key key{&program, &quality, faded_out ? kAnyHeld : held};
+    if (!samples) {
+      uncacheable.insert(key);
+      return nullptr;
+    }
+    // A note released before the cached one's length can still fade out
+    // first, and lands on the same kAnyHeld key. Its buffer is the shorter
+    // one, so it serves every held time the old one did and replaces it.
+    auto existing = entries.find(key);
+    if (existing != entries.end()) {
+      used_bytes -= existing->second.samples->size() * sizeof(float);
+      lru.erase(existing->second.lru);
+      entries.erase(existing);
+    }
+    lru.push_front(key);
+    entries[key] = Entry{samples, lru.begin()};
+    used_bytes += samples->size() * sizeof(float);
+    while (used_bytes > budget_bytes && lru.size() > 1) {
+      auto victim = entries.find(lru.back());
+      used_bytes -= victim->second.samples->size() * sizeof(float);
+      entries.erase(victim);
+      lru.pop_back();
+      ++evictions;
+    }
+    return samples;
+  }
+
+ private:
+  // Renders the note from its note-on until it finishes. Sets faded_out if
+  // it finished before being released.
+  static Buffer Render(const Program& program, const Quality& quality, size_t held,
+                       bool* faded_out) {
+    const size_t max_samples = static_cast<size_t>(kMaxCachedSeconds * quality.sample_rate);
+    // Any note sounds the same.
+    Note voice(program, 0, 1.0, 0.0, quality);
+    std::vector<float> samples;
+    double block[kBlockSize];
+    for (size_t i = 0; i < max_samples; ) {
+      if (i == held)
+        voice.Release(1.0 * i / quality.sample_rate);
+      size_t n = kBlockSize;
+      if (i < held)
+        n = std::min(n, held - i);
+      std::fill(block, block + n, 0.0);
+      voice.Render(block, i, n);
+      samples.insert(samples.end(), block, block + n);
+      i += n;
+      if (voice.IsFinished(1.0 * (i - 1) / quality.sample_rate)) {
+        *faded_out = !voice.is_released();
+        return std::make_shared<const std::vector<float>>(std::move(samples));
+      }
+    }
+    return nullptr;
+  }
+
+  std::map<Key, Entry> entries;
+  // Most recently used first.
+  std::list<Key> lru;
+  std::set<Key> uncacheable;
+};
+
+inline double Now() {
+  return std::chrono::duration<double>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Upper bounds of the histogram buckets in milliseconds. A last bucket
+// counts everything longer.
+constexpr double kHistogramBucketsMs[] = {10, 20, 50, 100, 200, 500, 1000, 2000, 5000, 10000};
+constexpr size_t kNumHistogramBuckets =
+  sizeof(kHistogramBucketsMs) / sizeof(kHistogramBucketsMs[0]) + 1;
+
+struct Histogram {
+  uint64_t counts[kNumHistogramBuckets] = {};
+
+  void Add(double seconds) {
+    size_t i = 0;
+    while (i + 1 < kNumHistogramBuckets && seconds * 1000.0 > kHistogramBucketsMs[i])
+      ++i;
+    ++counts[i];
+  }
+};
+
+// What Render() spends its time on and how many voices it keeps busy. Only
+// collected if a RenderStats is passed to it; otherwise the render loop only
+// pays for a null check per voice and block. Times are in seconds.
+struct RenderStats {
+  // Handling events, excluding the synthesis in between.
+  double schedule = 0.0;
+  double synthesis = 0.0;
+  // Upsampling to kSampleRate for the faster qualities.
+  double resample = 0.0;
+  std::map<const Program*, double> program_synthesis;
+  double channel_synthesis[16] = {};
+
+  // <time, active voices>, recorded whenever the count changes.
+  std::vector<std::pair<double, size_t>> polyphony;
+  size_t peak_polyphony = 0;
+  uint64_t voices_stolen = 0;
+  // From note-on until the voice is retired.
+  Histogram lifetime;
+  // From note-off until the voice is retired, for released voices.
+  Histogram release_tail;
+
+  void RecordPolyphony(double t, size_t active) {
+    peak_polyphony = std::max(peak_polyphony, active);
+    if (polyphony.empty() || polyphony.back().second != active)
+      polyphony.emplace_back(t, active);
+  }
+
+  void RecordRetired(const Note& note, double t) {
+    lifetime.Add(t - note.start_time);
+    if (note.is_released())
+      release_tail.Add(t + note.pressed_time);
+  }
+};
+
+struct Voice {
+  int channel = 0;
+  // Increases with every note-on; the smallest one is the oldest voice.
+  uint64_t serial = 0;
+  Note note;
+  // If set, these samples are played back instead of rendering note.
+  VoiceCache::Buffer rendered;
+  size_t rendered_pos = 0;
+};
+
+// A fixed number of voices shared by all channels. Active voices are kept
+// packed at the front of the array so that rendering only touches those, and
+// nothing is allocated after construction. When every voice is in use a new
+// note steals the voice that was released the longest ago, or the oldest one
+// if none has been released yet.
+struct VoicePool {
+  std::vector<Voice> voices;
+  size_t num_active = 0;
+  uint64_t next_serial = 0;
+  const Quality& quality;
+  VoiceCache* cache;
+  RenderStats* stats;
+
+  VoicePool(size_t polyphony, const Quality& quality, VoiceCache* cache, RenderStats* stats)
+      : voices(polyphony)
+      , quality(quality)
+      , cache(cache)
+      , stats(stats) {
+  }
+
+  // held is the number of samples until the note-off, if known.
+  void NoteOn(int channel, const Program& program, int note, double velocity, double t, size_t held) {
+    if (voices.empty())
+      return;
+    // A retriggered note releases the one still sounding.
+    NoteOff(channel, note, t);
+    Voice& voice = num_active < voices.size() ? voices[num_active++] : Steal(t);
+    voice.channel = channel;
+    voice.serial = next_serial++;
+    voice.note = Note(program, note, velocity, t, quality);
+    voice.rendered = cache ? cache->Get(program, quality, held) : nullptr;
+    voice.rendered_pos = 0;
+  }
+
+  void NoteOff(int channel, int note, double t) {
+    for (size_t i = 0; i < num_active; ++i) {
+      Voice& voice = voices[i];
+      if (voice.channel == channel && voice.note.note == note && !voice.note.is_released())
+        voice.note.Release(t);
+    }
+  }
+
+  // Adds n samples starting at first_sample to out, then retires the voices
+  // that have finished or become inaudible by the end of the block.
+  void Render(double* out, size_t first_sample, size_t n) {
+    const double t = 1.0 * (first_sample + n - 1) / quality.sample_rate;
+    for (size_t i = 0; i < num_active; ) {
+      Voice& voice = voices[i];
+      const double begin = stats ? Now() : 0.0;
+      bool finished;
+      if (voice.rendered) {
+        const std::vector<float>& samples = *voice.rendered;
+        const size_t m = std::min(n, samples.size() - voice.rendered_pos);
+        for (size_t j = 0; j < m; ++j)
+          out[j] += voice.note.velocity * samples[voice.rendered_pos + j];
+        voice.rendered_pos += m;
+        finished = voice.rendered_pos == samples.size();
+      } else {
+        voice.note.Render(out, first_sample, n);
+        finished = voice.note.IsFinished(t);
+      }
+      if (stats) {
+        const double elapsed = Now() - begin;
+        stats->program_synthesis[voice.note.program] += elapsed;
+        stats->channel_synthesis[voice.channel] += elapsed;
+        if (finished)
+          stats->RecordRetired(voice.note, t);
+      }
+      if (finished) {
+        voice.rendered.reset();
+        std::swap(voices[i], voices[--num_active]);
+      } else {
+        ++i;
+      }
+    }
+  }
+
+ private:
+  Voice& Steal(double t) {
+    Voice* victim = &voices[0];
+    for (size_t i = 1; i < num_active; ++i) {
+      Voice& voice = voices[i];
+      const bool released = voice.note.is_released();
+      if (released != victim->note.is_released()) {
+        if (released)
+          victim = &voice;
+      } else if (released ? voice.note.pressed_time > victim->note.pressed_time
+                          : voice.serial < victim->serial) {
+        victim = &voice;
+      }
+    }
+    if (stats) {
+      ++stats->voices_stolen;
+      stats->RecordRetired(victim->note, t);
+    }
+    return *victim;
+  }
+};
+
+struct Channel {
+  const Program& program;
+  const int number;
+  VoicePool& voices;
+
+  Channel(const Program& program, int number, VoicePool& voices)
+      : program(program)
+      , number(number)
+      , voices(voices) {
+  }
+
+  void NoteOn(int note, int velocity, double t, size_t held) {
+    if (velocity == 0) {
+      NoteOff(note, t);
+      return;
+    }
+    voices.NoteOn(number, program, note, 1.0 * velocity / 0x7F, t, held);
+  }
+
+  void NoteOff(int note, double t) {
+    voices.NoteOff(number, note, t);
+  }
+};
+
+// Returns, for every note-on, the number of samples until it's released by a
+// note-off or a retrigger of the same note on its channel. Notes never
+// released get kAnyHeld.
+inline std::vector<size_t> GetHeldSamples(const Song& song, int32_t sample_rate) {
+  const std::vector<MIDIEvent>& events = song.events;
+  std::vector<size_t> held(events.size(), kAnyHeld);
+  // <<channel, note>, index of the note-on>
+  std::map<std::pair<int, int>, size_t> pressed;
+  for (size_t i = 0; i < events.size(); ++i) {
+    const MIDIEvent& event = events[i];
+    if (event.event_type() != NOTE_ON && event.event_type() != NOTE_OFF)
+      continue;
+    const std::pair<int, int> key(event.channel(), event.note());
+    auto it = pressed.find(key);
+    if (it != pressed.end()) {
+      const size_t begin = FirstSampleAt(song.GetTime(events[it->second]), sample_rate);
+      held[it->second] = FirstSampleAt(song.GetTime(event), sample_rate) - begin;
+      pressed.erase(it);
+    }
+    if (event.event_type() == NOTE_ON && event.velocity() > 0)
+      pressed[key] = i;
+  }
+  return held;
+}
+
+inline std::map<int, Program> DefaultPrograms() {
+  return {
+    // Percussion
+    {-1, Program{{Operator{Envelope{0.00, 0.01, 0.0, 0.0, false}, SAW, -100.0, 1.0, {
+                    Operator{Envelope{0.00, 0.0, 1.0, 0.0, false}, SAW, -200.0, 10.0, {}}}}}}},
+    // Electric Piano
+    {5, Program{{Operator{Envelope{0.0, 2.0, 0.0, 0.1, false}, SINE, 1.0, 0.8, {
+                    Operator{Envelope{0.0, 2.0, 0.0, 0.1, false}, SINE, 14.0, 0.2, {}}}}}}},
+    // Slap Bass 1
+    {36, Program{{Operator{Envelope{0.0, 0.2, 0.7, 0.1, false}, SINE, 2.0, 1.0, {
+                    Operator{Envelope{0.0, 0.2, 0.0, 0.1, false}, SINE, 1.0, 4.0, {}}}}}}},
+    // Voice Aahs
+    {52, Program{{Operator{Envelope{0.0, 0.0, 1.0, 0.0, false}, SINE, 1.0, 0.2, {
+                    Operator{Envelope{0.0, 0.0, 1.0, 0.0, false}, SINE, 1.0, 5.0, {}}}}}}},
+    // Saw Lead
+    {81, Program{{Operator{Envelope{0.0, 0.0, 1.0, 0.0, false}, SAW, 1.0, 0.2, {}}}}},
+    };
+}
+
+// Taps of the resampling filter for each output phase.
+constexpr int kResamplerTaps = 8;
+
+// Upsamples in place by an integer factor with a Blackman-windowed sinc
+// low-pass filter, split into one short filter per output phase so that the
+// inserted zeros are never multiplied. samples holds size inputs followed by
+// zeros and ends up with out_size outputs. Inputs are taken a block at a time
+// from the end, so outputs only overwrite inputs that are no longer needed;
+// each block's inputs are copied out first, zero-padded past either end,
+// which also spares the filter any bounds checks. Silent blocks are only
+// cleared, and not even that past the inputs.
+inline void Upsample(std::vector<double>* samples, size_t size, int factor, size_t out_size) {
+  const int length = kResamplerTaps * factor;
+  const size_t half = kResamplerTaps / 2;
+  // Output n * factor + p is the dot product of the kResamplerTaps taps from
+  // taps[p * kResamplerTaps] with the inputs from n - half + 1.
+  std::vector<double> taps(length);
+  for (int m = 0; m < length; ++m) {
+    const double x = 1.0 * (m - length / 2) / factor;
+    const double sinc = x == 0.0 ? 1.0 : sin(pi * x) / (pi * x);
+    const double window =
+      0.42 - 0.5 * cos(2 * pi * m / length) + 0.08 * cos(4 * pi * m / length);
+    taps[m % factor * kResamplerTaps + kResamplerTaps - 1 - m / factor] = sinc * window;
+  }
+
+  if (samples->size() < out_size)
+    samples->resize(out_size);
+  double* data = samples->data();
+  const size_t num_inputs = (out_size + factor - 1) / factor;
+  const size_t num_blocks = (num_inputs + kBlockSize - 1) / kBlockSize;
+  // Inputs from n - half + 1 to n + count + half - 1.
+  double window[kBlockSize + kResamplerTaps - 1];
+  for (size_t block = num_blocks; block-- > 0; ) {
+    const size_t n = block * kBlockSize;
+    const size_t count = std::min(kBlockSize, num_inputs - n);
+    const size_t window_size = count + kResamplerTaps - 1;
+    if (n + 1 >= half && n + 1 - half + window_size <= size) {
+      memcpy(window, data + n + 1 - half, sizeof(double) * window_size);
+    } else {
+      for (size_t i = 0; i < window_size; ++i) {
+        const size_t k = n + i + 1;
+        window[i] = k >= half && k - half < size ? data[k - half] : 0.0;
+      }
+    }
+    double* out = data + n * factor;
+    const size_t out_count = std::min(count * factor, out_size - n * factor);
+    if (std::all_of(window, window + window_size, [](double x) { return x == 0.0; })) {
+      if (n * factor < size)
+        std::fill(out, out + std::min(out_count, size - n * factor), 0.0);
+      continue;
+    }
+    // Inputs with every output in range, then the rest of the last one.
+    const size_t whole = out_count / factor;
+    FmInterpolate(taps.data(), kResamplerTaps, factor, window, out, whole);
+    for (size_t p = 0; p < out_count - whole * factor; ++p) {
+      double sum = 0.0;
+      for (int j = 0; j < kResamplerTaps; ++j)
+        sum += taps[p * kResamplerTaps + j] * window[whole + j];
+      out[whole * factor + p] = sum;
+    }
+  }
+  samples->resize(out_size);
+}
+
+// Renders the song into unnormalized samples at kSampleRate. cache and stats
+// may be null.
+inline std::vector<double> Render(const Song& song,
+                                  const std::map<int, Program>& programs,
+                                  size_t polyphony,
+                                  const Quality& quality,
+                                  VoiceCache* cache,
+                                  RenderStats* stats) {
+  const double begin = stats ? Now() : 0.0;
+  const int32_t sample_rate = quality.sample_rate;
+  const std::vector<MIDIEvent>& events = song.events;
+  const size_t num_samples = static_cast<size_t>(sample_rate * song.duration());
+  const size_t out_size = static_cast<size_t>(kSampleRate * song.duration());
+  // Upsampled in place, so there's room for the output from the start.
+  std::vector<double> raw_double(std::max(num_samples, out_size));
+
+  auto it = events.begin();
+
+  const std::vector<size_t> held = GetHeldSamples(song, sample_rate);
+  VoicePool voices(polyphony, quality, cache, stats);
+  std::map<int, Channel> channels;
+  for (size_t i = 0; i < num_samples; ) {
+    const double t = 1.0 * i / sample_rate;
+    if (it != events.end() && t >= song.GetTime(*it)) {
+      // The event is triggered.
+      if (it->event_type() == NOTE_ON) {
+        auto cit = channels.find(it->channel());
+        if (cit != channels.end())
+          cit->second.NoteOn(it->note(), it->velocity(), t, held[it - events.begin()]);
+      } else if (it->event_type() == NOTE_OFF) {
+        auto cit = channels.find(it->channel());
+        if (cit != channels.end())
+          cit->second.NoteOff(it->note(), t);
+      } else if (it->event_type() == PROGRAM_CHANGE) {
+        auto pit = programs.find(it->program());
+        if (pit != programs.end()) {
+          channels.emplace(std::piecewise_construct,
+                           std::forward_as_tuple(it->channel()),
+                           std::forward_as_tuple(pit->second, it->channel(), voices));
+        } else if (it->channel() == 9) {
+          pit = programs.find(-1);
+          channels.emplace(std::piecewise_construct,
+                           std::forward_as_tuple(it->channel()),
+                           std::forward_as_tuple(pit->second, it->channel(), voices));
+        } else {
+          printf("program %d not found; channel %d will be muted \n", it->program(), it->channel());
+        }
+      }
+      ++it;
+    }
+
+    // Render up to the sample at which the next event is triggered. At most
+    // one event is handled per sample. While no voice is active the samples
+    // are left silent and the whole span is skipped at once.
+    size_t end = num_samples;
+    if (voices.num_active > 0)
+      end = std::min(i + kBlockSize, end);
+    if (it != events.end())
+      end = std::min(end, std::max(i + 1, FirstSampleAt(song.GetTime(*it), sample_rate)));
+    if (voices.num_active > 0) {
+      const double synthesis_begin = stats ? Now() : 0.0;
+      if (stats)
+        stats->RecordPolyphony(t, voices.num_active);
+      voices.Render(&raw_double[i], i, end - i);
+      if (stats)
+        stats->synthesis += Now() - synthesis_begin;
+    } else if (stats) {
+      stats->RecordPolyphony(t, 0);
+    }
+    i = end;
+  }
+  if (stats)
+    stats->schedule += Now() - begin - stats->synthesis;
+  if (sample_rate != kSampleRate) {
+    const double resample_begin = stats ? Now() : 0.0;
+    Upsample(&raw_double, num_samples, kSampleRate / sample_rate, out_size);
+    if (stats)
+      stats->resample += Now() - resample_begin;
+  }
+  return raw_double;
+}
+
+// Writes raw_double as a 16-bit WAV file, scaled so that the loudest sample
+// is at 30000.
+inline bool WriteWav(const char* path, const std::vector<double>& raw_double) {
+  double max_value = 0.0;
+  if (!raw_double.empty())
+    max_value = *std::max_element(raw_double.begin(), raw_double.end());
+  WavWriter writer;
+  if (!writer.Open(path, kSampleRate))
+    return false;
+  writer.Write(raw_double.data(), raw_double.size(), max_value > 0.0 ? 30000.0 / max_value : 0.0);
+  return writer.Close();
+}
+
+// Writes stats as CSV if path ends with ".csv", or as JSON otherwise. Programs
+// are identified by their number in programs.
+inline bool WriteStats(const char* path, const RenderStats& stats,
+                       const std::map<int, Program>& programs) {
+  FILE* fp = fopen(path, "w");
+  if (!fp) {
+    perror("fopen");
+    return false;
+  }
+  const size_t length = strlen(path);
+  const bool csv = length >= 4 && strcmp(path + length - 4, ".csv") == 0;
+
+  std::vector<std::pair<int, double>> program_synthesis;
+  for (const auto& p : programs) {
+    auto it = stats.program_synthesis.find(&p.second);
+    if (it != stats.program_synthesis.end())
+      program_synthesis.emplace_back(p.first, it->second);
+  }
+  const std::pair<const char*, const Histogram*> histograms[] = {
+    {"lifetime_ms", &stats.lifetime},
+    {"release_tail_ms", &stats.release_tail},
+  };
+
+  if (csv) {
+    fprintf(fp, "section,key,value\n");
+    fprintf(fp, "summary,schedule_seconds,%f\n", stats.schedule);
+    fprintf(fp, "summary,synthesis_seconds,%f\n", stats.synthesis);
+    fprintf(fp, "summary,resample_seconds,%f\n", stats.resample);
+    fprintf(fp, "summary,peak_polyphony,%zu\n", stats.peak_polyphony);
+    fprintf(fp, "summary,voices_stolen,%llu\n", (unsigned long long)stats.voices_stolen);
+    for (int i = 0; i < 16; ++i)
+      fprintf(fp, "channel_seconds,%d,%f\n", i, stats.channel_synthesis[i]);
+    for (const auto& p : program_synthesis)
+      fprintf(fp, "program_seconds,%d,%f\n", p.first, p.second);
+    for (const auto& histogram : histograms) {
+      for (size_t i = 0; i < kNumHistogramBuckets; ++i) {
+        if (i + 1 < kNumHistogramBuckets)
+          fprintf(fp, "%s,%g,%llu\n", histogram.first, kHistogramBucketsMs[i],
+                  (unsigned long long)histogram.second->counts[i]);
+        else
+          fprintf(fp, "%s,inf,%llu\n", histogram.first,
+                  (unsigned long long)histogram.second->counts[i]);
+      }
+    }
+    for (const auto& p : stats.polyphony)
+      fprintf(fp, "polyphony,%f,%zu\n", p.first, p.second);
+  } else {
+    fprintf(fp, "{\n");
+    fprintf(fp, "  \"schedule_seconds\": %f,\n", stats.schedule);
+    fprintf(fp, "  \"synthesis_seconds\": %f,\n", stats.synthesis);
+    fprintf(fp, "  \"resample_seconds\": %f,\n", stats.resample);
+    fprintf(fp, "  \"peak_polyphony\": %zu,\n", stats.peak_polyphony);
+    fprintf(fp, "  \"voices_stolen\": %llu,\n", (unsigned long long)stats.voices_stolen);
+    fprintf(fp, "  \"channel_seconds\": [");
+    for (int i = 0; i < 16; ++i)
+      fprintf(fp, "%s%f", i ? ", " : "", stats.channel_synthesis[i]);
+    fprintf(fp, "],\n");
+    fprintf(fp, "  \"program_seconds\": {");
+    for (size_t i = 0; i < program_synthesis.size(); ++i) {
+      fprintf(fp, "%s\"%d\": %f", i ? ", " : "",
+              program_synthesis[i].first, program_synthesis[i].second);
+    }
+    fprintf(fp, "},\n");
+    for (const auto& histogram : histograms) {
+      // Upper bounds; null for the last bucket.
+      fprintf(fp, "  \"%s\": [", histogram.first);
+      for (size_t i = 0; i < kNumHistogramBuckets; ++i) {
+        if (i + 1 < kNumHistogramBuckets)
+          fprintf(fp, "%s[%g, %llu]", i ? ", " : "", kHistogramBucketsMs[i],
+                  (unsigned long long)histogram.second->counts[i]);
+        else
+          fprintf(fp, ", [null, %llu]", (unsigned long long)histogram.second->counts[i]);
+      }
+      fprintf(fp, "],\n");
+    }
+    // [time, active voices]
+    fprintf(fp, "  \"polyphony\": [");
+    for (size_t i = 0; i < stats.polyphony.size(); ++i) {
+      fprintf(fp, "%s[%f, %zu]", i ? ", " : "",
+              stats.polyphony[i].first, stats.polyphony[i].second);
+    }
+    fprintf(fp, "]\n");
+    fprintf(fp, "}\n");
+  }
+  fclose(fp);
+  return true;
+}
+
+// Runs jobs 0 to num_jobs - 1 on num_threads threads, passing each its job
+// and thread index. Jobs are dealt round-robin in index order, so every
+// thread works through its share front to back. A thread that runs dry
+// steals from the back of the other threads' queues; since jobs never add
+// jobs, it's done once every queue is empty.
+inline void RunWorkStealing(size_t num_jobs, size_t num_threads,
+                            const std::function<void(size_t job, size_t thread)>& run) {
+  struct WorkQueue {
+    std::mutex mutex;
+    std::deque<size_t> jobs;
+  };
+  num_threads = std::max<size_t>(1, std::min(num_threads, num_jobs));
+  std::vector<WorkQueue> queues(num_threads);
+  for (size_t i = 0; i < num_jobs; ++i)
+    queues[i % num_threads].jobs.push_back(i);
+
+  auto worker = [&](size_t thread) {
+    for (;;) {
+      size_t job = num_jobs;
+      for (size_t i = 0; i < num_threads && job == num_jobs; ++i) {
+        WorkQueue& queue = queues[(thread + i) % num_threads];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.jobs.empty())
+          continue;
+        if (i == 0) {
+          job = queue.jobs.front();
+          queue.jobs.pop_front();
+        } else {
+          job = queue.jobs.back();
+          queue.jobs.pop_back();
+        }
+      }
+      if (job == num_jobs)
+        return;
+      run(job, thread);
+    }
+  };
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < num_threads; ++i)
+    threads.emplace_back(worker, i);
+  worker(0);
+  for (auto& thread : threads)
+    thread.join();
+}
+
+struct BatchJob {
+  std::string input_path;
+  std::string output_path;
+  // Seconds of audio, from the event timeline.
+  double duration = 0.0;
+  double wall_seconds = 0.0;
+  bool ok = false;
+};
+
+struct BatchStats {
+  size_t songs = 0;
+  size_t failed = 0;
+  double audio_seconds = 0.0;
+  double wall_seconds = 0.0;
+  // Summed over jobs, so busy_seconds / wall_seconds is the average number
+  // of threads kept busy.
+  double busy_seconds = 0.0;
+  size_t threads = 0;
+  uint64_t cache_hits = 0;
+  uint64_t cache_misses = 0;
+
+  double realtime_factor() const {
+    return wall_seconds > 0.0 ? audio_seconds / wall_seconds : 0.0;
+  }
+};
+
+// Renders every job on a work-stealing pool of num_threads threads. Songs are
+// first parsed to estimate their length and then rendered longest first, so
+// that a long song started last doesn't keep one thread busy after the rest
+// are done. Programs are shared by every job; each thread keeps its own voice
+// cache of cache_bytes across the jobs it runs, so drum hits cached by one
+// song are reused by the next. Songs are loaded twice instead of being kept
+// in memory between the passes, since parsing is cheap next to rendering.
+inline BatchStats RenderBatch(std::vector<BatchJob>& jobs,
+                              const std::map<int, Program>& programs,
+                              size_t polyphony,
+                              const Quality& quality,
+                              size_t cache_bytes,
+                              size_t num_threads) {
+  BatchStats stats;
+  const double begin = Now();
+  num_threads = std::max<size_t>(1, std::min(num_threads, jobs.size()));
+  stats.threads = num_threads;
+
+  RunWorkStealing(jobs.size(), num_threads, [&](size_t i, size_t) {
+    Song song;
+    jobs[i].ok = LoadSong(jobs[i].input_path.c_str(), &song, 1);
+    jobs[i].duration = jobs[i].ok ? song.duration() : 0.0;
+  });
+  std::stable_sort(jobs.begin(), jobs.end(), [](const BatchJob& lhs, const BatchJob& rhs) {
+    return lhs.duration > rhs.duration;
+  });
+
+  std::vector<std::unique_ptr<VoiceCache>> caches;
+  for (size_t i = 0; i < num_threads; ++i)
+    caches.emplace_back(new VoiceCache(cache_bytes));
+  std::mutex mutex;
+  size_t done = 0;
+  RunWorkStealing(jobs.size(), num_threads, [&](size_t i, size_t thread) {
+    BatchJob& job = jobs[i];
+    const double job_begin = Now();
+    Song song;
+    if (job.ok && LoadSong(job.input_path.c_str(), &song, 1)) {
+      // Songs running at once on every thread can still need more memory
+      // than there is; that fails the song, not the batch.
+      try {
+        const std::vector<double> raw_double =
+          Render(song, programs, polyphony, quality, caches[thread].get(), nullptr);
+        job.ok = WriteWav(job.output_path.c_str(), raw_double);
+      } catch (const std::bad_alloc&) {
+        printf("%s: out of memory\n", job.input_path.c_str());
+        job.ok = false;
+      }
+    } else {
+      job.ok = false;
+    }
+    job.wall_seconds = Now() - job_begin;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    ++done;
+    printf("[%zu/%zu] %s %.1f s in %.3f s%s\n", done, jobs.size(), job.input_path.c_str(),
+           job.duration, job.wall_seconds, job.ok ? "" : " FAILED");
+  });
+
+  stats.wall_seconds = Now() - begin;
+  for (const BatchJob& job : jobs) {
+    ++stats.songs;
+    stats.busy_seconds += job.wall_seconds;
+    if (job.ok)
+      stats.audio_seconds += job.duration;
+    else
+      ++stats.failed;
+  }
+  for (const auto& cache : caches) {
+    stats.cache_hits += cache->hits;
+    stats.cache_misses += cache->misses;
+  }
+  return stats;
+}
+
+#endif  // MIDI_H_
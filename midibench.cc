@@ -0,0 +1,343 @@
+// g++ -std=c++11 -O2 -pthread midibench.cc -o midibench && ./midibench
+//
+// Renders BGM8.MID (or the given files) and a few generated stress songs at
+// every quality, and reports how fast each one renders compared to real time
+// along with where the time goes. Each render is repeated (-n, 5 by default)
+// and the fastest run is kept, which keeps timer noise well inside the
+// regression tolerance. With -s the results are saved as a baseline, and with
+// -r they are compared against one; the exit status is 1 if anything regressed.
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <new>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include "midi.h"
+
+std::atomic<uint64_t> allocation_count(0);
+// Bytes allocated with new and not yet deleted, and the most there have been
+// since peak_bytes was last reset. Unlike the process's peak RSS, which only
+// ever grows, this can be measured per render.
+std::atomic<size_t> live_bytes(0);
+std::atomic<size_t> peak_bytes(0);
+
+// Every block starts with its size, padded so that what new returns stays
+// aligned for any type.
+constexpr size_t kBlockHeaderSize = alignof(std::max_align_t);
+
+// Kept out of line; GCC's -Wmismatched-new-delete can't tell that these pair
+// up once they're inlined.
+__attribute__((noinline)) void* operator new(size_t size) {
+  ++allocation_count;
+  uint8_t* block = static_cast<uint8_t*>(malloc(kBlockHeaderSize + size));
+  if (!block)
+    throw std::bad_alloc();
+  *reinterpret_cast<size_t*>(block) = size;
+  const size_t live = live_bytes += size;
+  size_t peak = peak_bytes;
+  while (live > peak && !peak_bytes.compare_exchange_weak(peak, live)) {
+  }
+  return block + kBlockHeaderSize;
+}
+
+__attribute__((noinline)) void operator delete(void* p) noexcept {
+  if (!p)
+    return;
+  uint8_t* block = static_cast<uint8_t*>(p) - kBlockHeaderSize;
+  live_bytes -= *reinterpret_cast<size_t*>(block);
+  free(block);
+}
+
+// What C++14 and later call for objects of known size. The size is already in
+// the block, so this is the same as the unsized one.
+__attribute__((noinline)) void operator delete(void* p, size_t) noexcept {
+  operator delete(p);
+}
+
+// Builds songs event by event. Times are in ticks at 480 ticks per beat and
+// 120 bpm.
+struct SongBuilder {
+  Song song;
+
+  SongBuilder() {
+    song.header.format = 1;
+    song.header.division = 480;
+  }
+
+  void ProgramChange(uint32_t tick, int channel, int program) {
+    Add(tick, PROGRAM_CHANGE | channel, program, 0);
+  }
+
+  void AddNote(uint32_t tick, uint32_t length, int channel, int note, int velocity) {
+    Add(tick, NOTE_ON | channel, note, velocity);
+    Add(tick + length, NOTE_OFF | channel, note, 0);
+  }
+
+  Song Build() {
+    std::stable_sort(song.events.begin(), song.events.end(),
+                     [](const MIDIEvent& lhs, const MIDIEvent& rhs) {
+                       return lhs.absolute_time < rhs.absolute_time;
+                     });
+    return song;
+  }
+
+ private:
+  void Add(uint32_t tick, int status, int data1, int data2) {
+    MIDIEvent event;
+    event.absolute_time = tick;
+    event.status = status;
+    event.data1 = data1;
+    event.data2 = data2;
+    song.events.push_back(event);
+  }
+};
+
+// 48-note chords on every beat held for two beats, well past the polyphony
+// limit.
+Song MakePolyphonySong(int seconds) {
+  SongBuilder builder;
+  builder.ProgramChange(0, 0, 5);
+  for (int beat = 0; beat < seconds * 2; ++beat) {
+    for (int i = 0; i < 48; ++i)
+      builder.AddNote(beat * 480, 960, 0, 36 + i, 100);
+  }
+  return builder.Build();
+}
+
+// Every channel busy with eighth notes, drums on channel 9.
+Song MakeChannelsSong(int seconds) {
+  const int kPrograms[] = {5, 36, 52, 81};
+  SongBuilder builder;
+  for (int channel = 0; channel < 16; ++channel)
+    builder.ProgramChange(0, channel, kPrograms[channel % 4]);
+  uint32_t seed = 1;
+  for (int eighth = 0; eighth < seconds * 4; ++eighth) {
+    for (int channel = 0; channel < 16; ++channel) {
+      seed = seed * 1103515245 + 12345;
+      builder.AddNote(eighth * 240, 200, channel, 36 + (seed >> 16) % 48, 64 + (seed >> 8) % 64);
+    }
+  }
+  return builder.Build();
+}
+
+// A sparse melody with drums and long rests.
+Song MakeLongSong(int seconds) {
+  SongBuilder builder;
+  builder.ProgramChange(0, 0, 81);
+  builder.ProgramChange(0, 9, 0);
+  for (int bar = 0; bar < seconds / 2; ++bar) {
+    if (bar % 4 == 3)
+      continue;
+    for (int beat = 0; beat < 4; ++beat) {
+      const uint32_t tick = (bar * 4 + beat) * 480;
+      builder.AddNote(tick, 240, 0, 60 + (bar * 4 + beat) % 12, 100);
+      builder.AddNote(tick, 60, 9, beat % 2 ? 38 : 36, 120);
+    }
+  }
+  return builder.Build();
+}
+
+struct Scenario {
+  std::string name;
+  Song song;
+  double parse_seconds;
+
+  Scenario(const std::string& name, const Song& song, double parse_seconds)
+      : name(name)
+      , song(song)
+      , parse_seconds(parse_seconds) {
+  }
+};
+
+struct Result {
+  double audio_seconds = 0.0;
+  double wall_seconds = 0.0;
+  double parse_seconds = 0.0;
+  // Resampling, conversion to 16 bits and writing the WAV file.
+  double output_seconds = 0.0;
+  RenderStats stats;
+  uint64_t allocations = 0;
+  // Most heap memory in use at once during the render, on top of what was
+  // already in use before it.
+  double peak_memory_mib = 0.0;
+
+  double realtime_factor() const {
+    return wall_seconds > 0.0 ? audio_seconds / wall_seconds : 0.0;
+  }
+};
+
+Result Run(const Scenario& scenario, const std::map<int, Program>& programs,
+           const Quality& quality, int iterations) {
+  Result best;
+  for (int i = 0; i < iterations; ++i) {
+    Result result;
+    result.audio_seconds = scenario.song.duration();
+    result.parse_seconds = scenario.parse_seconds;
+    const uint64_t allocations = allocation_count;
+    const size_t live = live_bytes;
+    peak_bytes = live;
+    const double begin = Now();
+    VoiceCache cache(kDefaultCacheMiB << 20);
+    const std::vector<double> raw_double =
+      Render(scenario.song, programs, kDefaultPolyphony, quality, &cache, &result.stats);
+    const double output_begin = Now();
+    WriteWav("/dev/null", raw_double);
+    result.output_seconds = Now() - output_begin + result.stats.resample;
+    result.wall_seconds = Now() - begin + result.parse_seconds;
+    result.allocations = allocation_count - allocations;
+    result.peak_memory_mib = (peak_bytes - live) / 1048576.0;
+    if (i == 0 || result.wall_seconds < best.wall_seconds)
+      best = result;
+  }
+  return best;
+}
+
+void Print(const std::string& name, const Result& result, const std::map<int, Program>& programs) {
+  printf("%-18s %8.1f %8.3f %8.1fx %7.3f %8.3f %9.3f %7.3f %8.1f %9llu\n",
+         name.c_str(), result.audio_seconds, result.wall_seconds, result.realtime_factor(),
+         result.parse_seconds, result.stats.schedule, result.stats.synthesis,
+         result.output_seconds, result.peak_memory_mib,
+         (unsigned long long)result.allocations);
+  for (const auto& p : programs) {
+    auto it = result.stats.program_synthesis.find(&p.second);
+    if (it != result.stats.program_synthesis.end())
+      printf("  program %3d %40.3f\n", p.first, it->second);
+  }
+  printf("  peak polyphony %zu, %llu voices stolen\n", result.stats.peak_polyphony,
+         (unsigned long long)result.stats.voices_stolen);
+}
+
+// <name, <realtime factor, allocations>>
+typedef std::map<std::string, std::pair<double, uint64_t>> Baseline;
+
+bool ReadBaseline(const char* path, Baseline* baseline) {
+  FILE* fp = fopen(path, "r");
+  if (!fp) {
+    perror("fopen");
+    return false;
+  }
+  char name[256];
+  double realtime_factor;
+  unsigned long long allocations;
+  while (fscanf(fp, "%255s %lf %llu", name, &realtime_factor, &allocations) == 3)
+    (*baseline)[name] = std::make_pair(realtime_factor, allocations);
+  fclose(fp);
+  return true;
+}
+
+bool WriteBaseline(const char* path, const std::map<std::string, Result>& results) {
+  FILE* fp = fopen(path, "w");
+  if (!fp) {
+    perror("fopen");
+    return false;
+  }
+  for (const auto& p : results) {
+    fprintf(fp, "%s %f %llu\n", p.first.c_str(), p.second.realtime_factor(),
+            (unsigned long long)p.second.allocations);
+  }
+  fclose(fp);
+  return true;
+}
+
+int main(int argc, char *argv[]) {
+  int iterations = 5;
+  const char* save_path = nullptr;
+  const char* baseline_path = nullptr;
+  double tolerance = 10.0;
+  int opt;
+  while ((opt = getopt(argc, argv, "n:s:r:t:")) != -1) {
+    switch (opt) {
+      case 'n':
+        iterations = std::max(1, atoi(optarg));
+        break;
+      case 's':
+        save_path = optarg;
+        break;
+      case 'r':
+        baseline_path = optarg;
+        break;
+      case 't':
+        tolerance = atof(optarg);
+        break;
+      default:
+        printf("usage: %s [-n iterations] [-s save_baseline] [-r compare_baseline] "
+               "[-t tolerance_percent] [input.mid...]\n", argv[0]);
+        return 1;
+    }
+  }
+
+  std::vector<Scenario> scenarios;
+  std::vector<const char*> paths(argv + optind, argv + argc);
+  if (paths.empty())
+    paths.push_back("BGM8.MID");
+  for (const char* path : paths) {
+    std::string name = path;
+    const size_t slash = name.rfind('/');
+    if (slash != std::string::npos)
+      name = name.substr(slash + 1);
+    Song song;
+    const double begin = Now();
+    if (!LoadSong(path, &song))
+      return 1;
+    scenarios.push_back(Scenario(name, song, Now() - begin));
+  }
+  scenarios.push_back(Scenario("polyphony", MakePolyphonySong(60), 0.0));
+  scenarios.push_back(Scenario("channels", MakeChannelsSong(60), 0.0));
+  scenarios.push_back(Scenario("long", MakeLongSong(600), 0.0));
+
+  const std::map<int, Program> programs = DefaultPrograms();
+
+  printf("%-18s %8s %8s %9s %7s %8s %9s %7s %8s %9s\n",
+         "song", "audio", "wall", "realtime", "parse", "schedule", "synthesis",
+         "output", "peak MiB", "allocs");
+  std::map<std::string, Result> results;
+  for (const Scenario& scenario : scenarios) {
+    double final_wall_seconds = 0.0;
+    for (const Quality& quality : kQualities) {
+      std::string name = scenario.name;
+      if (&quality != &kQualities[0])
+        name += std::string("@") + quality.name;
+      const Result& result = results[name] = Run(scenario, programs, quality, iterations);
+      Print(name, result, programs);
+      if (&quality == &kQualities[0])
+        final_wall_seconds = result.wall_seconds;
+      else
+        printf("  %.1fx faster than final\n", final_wall_seconds / result.wall_seconds);
+    }
+  }
+
+  if (save_path && !WriteBaseline(save_path, results))
+    return 1;
+
+  bool regressed = false;
+  if (baseline_path) {
+    Baseline baseline;
+    if (!ReadBaseline(baseline_path, &baseline))
+      return 1;
+    for (const auto& p : results) {
+      auto it = baseline.find(p.first);
+      if (it == baseline.end())
+        continue;
+      const double old_factor = it->second.first;
+      const double new_factor = p.second.realtime_factor();
+      const bool slower = new_factor < old_factor * (1.0 - tolerance / 100.0);
+      const bool more_allocations =
+        p.second.allocations > it->second.second * (1.0 + tolerance / 100.0);
+      printf("%-18s realtime %.1fx -> %.1fx (%+.1f%%), allocs %llu -> %llu%s\n",
+             p.first.c_str(), old_factor, new_factor,
+             100.0 * (new_factor / old_factor - 1.0),
+             (unsigned long long)it->second.second,
+             (unsigned long long)p.second.allocations,
+             slower || more_allocations ? "  REGRESSED" : "");
+      regressed = regressed || slower || more_allocations;
+    }
+  }
+  return regressed ? 1 : 0;
+}
@@ -0,0 +1,46 @@
+// g++ -std=c++11 -O1 -g -fsanitize=address -pthread voicecachetest.cc -o voicecachetest && ./voicecachetest
+//
+// A drum hit that fades out before its note-off is cached once for every held
+// time. A shorter hit that still fades out before its note-off is a second
+// render of the same key; it has to replace the first entry, not leave it
+// dangling in the LRU list for eviction to trip over.
+#include <cstdio>
+#include <map>
+
+#include "midi.h"
+
+int main() {
+  const std::map<int, Program> programs = DefaultPrograms();
+  const Program& drum = programs.at(-1);
+  const Quality& quality = kQualities[0];
+
+  VoiceCache cache(3000);
+  VoiceCache::Buffer faded = cache.Get(drum, quality, kAnyHeld);
+  if (!faded) {
+    fprintf(stderr, "the drum wasn't cached\n");
+    return 1;
+  }
+  const size_t held = faded->size() - 62;
+  VoiceCache::Buffer shorter = cache.Get(drum, quality, held);
+  if (!shorter || shorter->size() > held) {
+    fprintf(stderr, "a %zu-sample hit wasn't cached as one that fades out\n", held);
+    return 1;
+  }
+  if (cache.used_bytes != shorter->size() * sizeof(float)) {
+    fprintf(stderr, "%zu bytes accounted for, %zu in the cache\n", cache.used_bytes,
+            shorter->size() * sizeof(float));
+    return 1;
+  }
+
+  // Goes well past the budget, so that every entry, the replaced one
+  // included, is evicted at some point.
+  for (size_t held = 1; held < 64; ++held)
+    cache.Get(drum, quality, held);
+  if (!cache.Get(drum, quality, kAnyHeld) || cache.used_bytes > cache.budget_bytes) {
+    fprintf(stderr, "%zu bytes accounted for after eviction\n", cache.used_bytes);
+    return 1;
+  }
+  printf("ok: %llu hits, %llu misses, %llu evictions\n", (unsigned long long)cache.hits,
+         (unsigned long long)cache.misses, (unsigned long long)cache.evictions);
+  return 0;
+}
@@ -0,0 +1,84 @@
+// Streaming writer of mono 16-bit WAV files, shared by midi.cc and
+// wavegen.cc.
+#ifndef WAV_H_
+#define WAV_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+
+struct WaveHeader {
+  WaveHeader(int32_t raw_length, int32_t sample_rate) : sample_rate(sample_rate) {
+    subchunk2_size = raw_length;
+    chunk_size = raw_length + 36;
+    byte_rate = sample_rate * num_channels * bits_per_sample / 8;
+    block_align = num_channels * bits_per_sample / 8;
+  }
+  char chunk_id[4] = {'R', 'I', 'F', 'F'};
+  int32_t chunk_size;
+  char format[4] = {'W', 'A', 'V', 'E'};
+
+  char subchunk1_id[4] = {'f', 'm', 't', ' '};
+  int32_t subchunk1_size = 16;
+  int16_t audio_format = 1;
+  int16_t num_channels = 1;
+  int32_t sample_rate;
+  int32_t byte_rate;
+  int16_t block_align;
+  int16_t bits_per_sample = 16;
+
+  char subchunk2_id[4] = {'d', 'a', 't', 'a'};
+  int32_t subchunk2_size;
+};
+
+// Samples are appended as they're produced, so callers never need the whole
+// file in memory. The header is written with empty sizes first and filled in
+// by Close().
+struct WavWriter {
+  FILE* fp = nullptr;
+  int32_t sample_rate = 0;
+  size_t num_samples = 0;
+
+  bool Open(const char* path, int32_t sample_rate) {
+    fp = fopen(path, "wb");
+    if (!fp) {
+      perror("fopen");
+      return false;
+    }
+    this->sample_rate = sample_rate;
+    num_samples = 0;
+    WaveHeader header(0, sample_rate);
+    fwrite(&header, sizeof(WaveHeader), 1, fp);
+    return true;
+  }
+
+  void Write(const int16_t* samples, size_t n) {
+    fwrite(samples, sizeof(int16_t), n, fp);
+    num_samples += n;
+  }
+
+  // Writes samples * scale, truncated to 16 bits.
+  void Write(const double* samples, size_t n, double scale) {
+    int16_t buffer[4096];
+    for (size_t i = 0; i < n; ) {
+      const size_t m = std::min(n - i, sizeof(buffer) / sizeof(buffer[0]));
+      for (size_t j = 0; j < m; ++j)
+        buffer[j] = scale * samples[i + j];
+      Write(buffer, m);
+      i += m;
+    }
+  }
+
+  bool Close() {
+    WaveHeader header(sizeof(int16_t) * num_samples, sample_rate);
+    // Pipes can't seek back; their sizes stay empty.
+    if (fseek(fp, 0, SEEK_SET) == 0)
+      fwrite(&header, sizeof(WaveHeader), 1, fp);
+    const bool ok = !ferror(fp);
+    fclose(fp);
+    fp = nullptr;
+    return ok;
+  }
+};
+
+#endif  // WAV_H_
@@ -1,32 +1,12 @@
-// g++ -std=c++11 wavegen.cc  && ./a.out && afplay test.wav
+// g++ -std=c++11 -O2 wavegen.cc && ./a.out && afplay test.wav
+#include <algorithm>
 #include <cstdint>
 #include <cstdio>
 #include <cmath>
 #include <vector>
 
-struct WaveHeader {
-  WaveHeader(int32_t raw_length) {
-    subchunk2_size = raw_length;
-    chunk_size = raw_length + 36;
-    byte_rate = sample_rate * num_channels * bits_per_sample / 8;
-    block_align = num_channels * bits_per_sample / 8;
-  }
-  char chunk_id[4] = {'R', 'I', 'F', 'F'};
-  int32_t chunk_size;
-  char format[4] = {'W', 'A', 'V', 'E'};
-
-  char subchunk1_id[4] = {'f', 'm', 't', ' '};
-  int32_t subchunk1_size = 16;
-  int16_t audio_format = 1;
-  int16_t num_channels = 1;
-  int32_t sample_rate = 44100;
-  int32_t byte_rate;
-  int16_t block_align;
-  int16_t bits_per_sample = 16;
-
-  char subchunk2_id[4] = {'d', 'a', 't', 'a'};
-  int32_t subchunk2_size;
-};
+#include "fmkernel.h"
+#include "wav.h"
 
 double PianoFreq(int n) {
   return pow(pow(2, 1.0 / 12.0), n - 49) * 440.0;
@@ -34,9 +14,14 @@ double PianoFreq(int n) {
 
 int main(int argc, char *argv[]) {
   const double pi = 3.14159265358979;
-  FILE *fp = fopen("test.wav", "wb");
+  const int kSampleRate = 44100;
+  const int kBlockSize = 4096;
+  WavWriter writer;
+  if (!writer.Open("test.wav", kSampleRate))
+    return 1;
   std::vector<int> doremi = {40, 42, 44, 45, 47, 49, 51, 52};
-  std::vector<int16_t> raw;
+  std::vector<double> modulation(kBlockSize);
+  std::vector<double> raw(kBlockSize);
 
   double Ibegin = 5;
   double Iend = 0;
@@ -44,15 +29,31 @@ int main(int argc, char *argv[]) {
   for (int n : doremi) {
     double c = PianoFreq(n) * 2.0 * pi;
     double m = c / cm;
-    for (int i = 0; i < 44100; ++i) {
-      double t = i / 44100.0;
-      double I = (Iend - Ibegin) * t + Ibegin;
-      raw.push_back(8192 * sin(c * t + I * sin(m * t)));
+    for (int i = 0; i < kSampleRate; i += kBlockSize) {
+      const int len = std::min(kBlockSize, kSampleRate - i);
+      double t = 1.0 * i / kSampleRate;
+      double dt = 1.0 * len / kSampleRate;
+
+      // I * sin(m * t), with I sweeping from Ibegin to Iend over the note.
+      FmOperator modulator;
+      modulator.phase = m * t;
+      modulator.increment = m / kSampleRate;
+      modulator.gain_begin = (Iend - Ibegin) * t + Ibegin;
+      modulator.gain_end = (Iend - Ibegin) * (t + dt) + Ibegin;
+      std::fill(modulation.begin(), modulation.end(), 0.0);
+      FmRender(modulator, modulation.data(), len);
+
+      // 8192 * sin(c * t + I * sin(m * t))
+      FmOperator carrier;
+      carrier.phase = c * t;
+      carrier.increment = c / kSampleRate;
+      carrier.gain_begin = carrier.gain_end = 8192;
+      carrier.modulation = modulation.data();
+      std::fill(raw.begin(), raw.end(), 0.0);
+      FmRender(carrier, raw.data(), len);
+
+      writer.Write(raw.data(), len, 1.0);
     }
   }
-  WaveHeader header(sizeof(int16_t) * raw.size());
-  fwrite(&header, sizeof(WaveHeader), 1, fp);
-  fwrite(&raw[0], sizeof(int16_t), raw.size(), fp);
-  fclose(fp);
-  return 0;
+  return writer.Close() ? 0 : 1;
 }